@@ -0,0 +1,71 @@
+#!/bin/bash
+#
+# Benchmarks fcheck on images made by mkimage over a sweep of sizes, and
+# prints its throughput on each. The image is read from the page cache after
+# the first run; the best of $RUNS runs is reported.
+#
+#   ./bench.sh                          # the default sweep
+#   SIZES="65536 1048576" ./bench.sh -j 4 --stream
+#
+# Arguments are passed on to fcheck. MKIMAGE_ARGS sets the shape of the
+# tree (see mkimage.c); TMPDIR where the images go. With PHASES=1, each size
+# is followed by fcheck --stats for one more run, giving the time, bytes,
+# page faults and (where perf counters are available) cycles and cache
+# misses of every phase.
+
+set -e
+cd "$(dirname "$0")"
+
+CC=${CC:-gcc}
+SIZES=${SIZES:-"65536 262144 1048576 4194304 16777216"}
+RUNS=${RUNS:-3}
+MKIMAGE_ARGS=${MKIMAGE_ARGS:-"-f 32 -d 6 -D 0.1 -l 0.05 -s 4 -x 0.05"}
+
+# The block size mkimage is asked for with -B, 512 by default, for MB/s.
+blockSize()
+{
+	local OPTIND opt size=512
+	while getopts "B:b:i:f:d:D:l:s:x:r:" opt
+	do
+		if [ "$opt" = B ]; then
+			size=$OPTARG
+		fi
+	done
+	echo "$size"
+}
+bsize=$(blockSize $MKIMAGE_ARGS)
+
+dir=$(mktemp -d "${TMPDIR:-/tmp}/fcheck-bench.XXXXXX")
+trap 'rm -rf "$dir"' EXIT
+
+$CC -O2 -pthread -o "$dir/fcheck" fcheck.c libfcheck.c
+$CC -O2 -o "$dir/mkimage" mkimage.c
+
+printf "%10s %8s %8s %10s %12s %12s %10s\n" blocks inodes files seconds inodes/s blocks/s MB/s
+for blocks in $SIZES
+do
+	summary=$("$dir/mkimage" -b "$blocks" $MKIMAGE_ARGS "$dir/fs.img")
+	inodes=$(echo "$summary" | sed 's/.* blocks, \([0-9]*\) inodes.*/\1/')
+	files=$(echo "$summary" | sed 's/.* \([0-9]*\) files.*/\1/')
+
+	best=
+	for run in $(seq "$RUNS")
+	do
+		start=$(date +%s%N)
+		"$dir/fcheck" "$@" "$dir/fs.img" || { echo "fcheck failed on $blocks blocks" >&2; exit 1; }
+		end=$(date +%s%N)
+		elapsed=$((end - start))
+		if [ -z "$best" ] || [ "$elapsed" -lt "$best" ]; then
+			best=$elapsed
+		fi
+	done
+
+	awk -v b="$blocks" -v i="$inodes" -v f="$files" -v ns="$best" -v bs="$bsize" 'BEGIN {
+		s = ns / 1e9
+		printf "%10d %8d %8d %10.4f %12.0f %12.0f %10.1f\n", b, i, f, s, i / s, b / s, b * bs / 1e6 / s
+	}'
+	if [ -n "$PHASES" ]; then
+		"$dir/fcheck" --stats "$@" "$dir/fs.img" | sed 's/^/    /'
+	fi
+	rm -f "$dir/fs.img"
+done
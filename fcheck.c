@@ -1,377 +1,348 @@
+// fcheck: checks an xv6 file system image for the violations listed in the
+// README, with libfcheck.
+
 #include <stdio.h>
-#include <sys/types.h>
-#include <sys/mman.h>
-#include <sys/stat.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
-#include <fcntl.h>
 #include <assert.h>
 #include <stdbool.h>
+#include <pthread.h>
+#include <getopt.h>
 
-#include "types.h"
-#include "fs.h"
-
-
-#define BLOCK_SIZE (BSIZE)
-
-#define T_DIR  1   // Directory
-#define T_FILE 2   // File
-#define T_DEV  3   // Special device
-
+#include "libfcheck.h"
 
-#define DIRECTADDR 1
-#define INDIRECTADDR 2
 
-int numinodes;
+#define STATS_TEXT 1
+#define STATS_JSON 2
 
-typedef struct Datablock{
+#define FORMAT_TEXT   0
+#define FORMAT_NDJSON 1 // see fcheck_ndjson()
 
-	bool bitset;
-	int usecount;
-	int inode;
-	int type;
 
-}Datablock;
+// An image of a batch, and what to print for it once checked
+typedef struct Job{
+	char *path;
+	bool done;
+	char *out;
+}Job;
 
+Job *jobs;
+size_t njobs, jobscap;
+size_t nextjob;   // next to check
+size_t nextprint; // next to print: lines come out in the order of the list
+bool batchfailed; // some image is not clean
+fcheck_opts batchopts;
+int format;       // FORMAT_TEXT or FORMAT_NDJSON
+pthread_mutex_t printlock = PTHREAD_MUTEX_INITIALIZER;
 
-typedef struct Inode{
-	int inuse;
-	int refcount;
-	int parentinode;
-}Inode;
 
-
-void throwerr(char *string)
+void usage(void)
 {
-	char buf[256];
-	sprintf(buf, "ERROR: %s\n", string);
-	fprintf(stderr, "%s", buf);
+	fprintf(stderr, "Usage: fcheck [-j threads] [--all] [--stream] [--state file] [--stats[=json]] [--geometry bsize[,ndirect]] [--format=ndjson] [--level=quick|normal|full] [--mem-limit=size] <file_system_image | ->\n"
+			"       fcheck [-j threads] [--geometry bsize[,ndirect]] [--level=normal|full] --repair <file_system_image>\n"
+			"       fcheck [-j threads] [--all] [--stream] [--geometry bsize[,ndirect]] [--format=ndjson] [--level=quick|normal|full] [--mem-limit=size] [--batch list] [file_system_image ...]\n");
 	exit(1);
 }
 
 
-bool isBlockUsed(char *addr, int blocknum)
+void addJob(char *path)
 {
-	int bmapblocknum = BBLOCK(blocknum, numinodes);
-	int bmapbit = blocknum % BPB;
-
-	char * bmap = addr + (bmapblocknum * BLOCK_SIZE);
-
-	int m = 1 << (bmapbit % 8);
-	if((bmap[bmapbit/8] & m) == 0) //bit not set. 
-		return false;		
-	else
-		return true;
+	if(njobs == jobscap)
+	{
+		jobscap = jobscap ? 2 * jobscap : 64;
+		jobs = realloc(jobs, jobscap * sizeof(Job));
+		assert(jobs != NULL);
+	}
+	jobs[njobs++] = (Job){path, false, NULL};
 }
 
 
-// Returns a char pointer to the beginning of the specified block number
-char *getBlock(char *startaddr, int blocknum)
+// Adds the images listed in a file, one path a line, "-" for stdin.
+void readList(char *listpath)
 {
-	return startaddr + (blocknum * BLOCK_SIZE);
-}
+	FILE *f = strcmp(listpath, "-") == 0 ? stdin : fopen(listpath, "r");
+	char *line = NULL;
+	size_t cap = 0;
+	ssize_t len;
 
-int
-main(int argc, char *argv[])
-{
-	int i,n,fsfd;
-	char *addr;
-	struct dinode *dip;
-	struct superblock *sb;
-	struct dirent *de;
-	struct stat statbuf;
-
-	if(argc < 2){
-		fprintf(stderr, "Usage: fcheck <file_system_image>\n");
+	if(f == NULL)
+	{
+		perror(listpath);
 		exit(1);
 	}
-
-	fsfd = open(argv[1], O_RDONLY);
-	if(fsfd < 0){
-		fprintf(stderr, "image not found.\n");
-		exit(1);
+	while((len = getline(&line, &cap, f)) != -1)
+	{
+		while(len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+			line[--len] = '\0';
+		if(len > 0)
+		{
+			addJob(strdup(line));
+			assert(jobs[njobs - 1].path != NULL);
+		}
 	}
+	free(line);
+	if(f != stdin)
+		fclose(f);
+}
 
-	/*DONE: Dont hard code the size of file. Use fstat to get the size */
-	assert(fstat(fsfd, &statbuf) == 0);
-
-	int filesize = statbuf.st_size;
 
-	addr = mmap(NULL, filesize, PROT_READ, MAP_PRIVATE, fsfd, 0);
-	if (addr == MAP_FAILED){
-		perror("mmap failed");
-		exit(1);
-	}
-	/* read the super block */
-	sb = (struct superblock *) (addr + 1 * BLOCK_SIZE);
+// The line to print for image j of a batch
+char *jobLine(size_t j, int result, const char *msg)
+{
+	size_t len = strlen(jobs[j].path) + strlen(msg) + 16;
+	char *line = malloc(len);
+
+	assert(line != NULL);
+	if(result == FCHECK_OK)
+		snprintf(line, len, "%s: ok\n", jobs[j].path);
+	else if(result == FCHECK_VIOLATION)
+		snprintf(line, len, "%s: ERROR: %s\n", jobs[j].path, msg);
+	else
+		snprintf(line, len, "%s: %s\n", jobs[j].path, msg);
+	return line;
+}
 
-	/* read the inodes */
-	dip = (struct dinode *) (addr + IBLOCK((uint)0)*BLOCK_SIZE);
 
-	numinodes = sb->ninodes;
+// Records how image j went, with out to print for it, and prints
+// everything that is now due.
+void finishJob(size_t j, int result, char *out)
+{
+	pthread_mutex_lock(&printlock);
+	jobs[j].out = out;
+	jobs[j].done = true;
+	if(result != FCHECK_OK)
+		batchfailed = true;
+	for(; nextprint < njobs && jobs[nextprint].done; nextprint++)
+	{
+		fputs(jobs[nextprint].out, stdout);
+		free(jobs[nextprint].out);
+	}
+	fflush(stdout);
+	pthread_mutex_unlock(&printlock);
+}
 
-	Datablock dblocks[sb->size];
-	memset(dblocks, 0, sizeof(Datablock) * sb->size);
 
-	Inode inodes[sb->ninodes];
-	memset(inodes, 0, sizeof(Inode) * sb->ninodes);
+// A thread of the batch pool: checks images off the list with one context,
+// so its buffers are reused from one image to the next.
+void *batchWorker(void *arg)
+{
+	fcheck_ctx *ctx = fcheck_new();
+	size_t j;
 
-	// loops through the inode BLOCKS
-	for(int inum = 0; inum < sb->ninodes; inum++)
+	while((j = __atomic_fetch_add(&nextjob, 1, __ATOMIC_RELAXED)) < njobs)
 	{
-		// check 1: Each inode is either unallocated or one of the valid types
-		if(dip[inum].type != 0 && dip[inum].type != T_DIR && dip[inum].type != T_FILE && dip[inum].type != T_DEV)
-			throwerr("bad inode.");
-
-		// check 2:  For in-use inodes, each block address that is used by 
-		// the inode is valid (points to a valid data block address within the image)
-		if(dip[inum].type != 0) 
+		if(ctx == NULL)
 		{
-			inodes[inum].inuse = true;
-			int blocknum = 0;
-			// go through direct blocks
-			for(int b = 0; b < NDIRECT; b++)
-			{
-				blocknum = dip[inum].addrs[b];
-				if(blocknum >= sb->size || blocknum < 0)
-					throwerr("bad direct address in inode.");
-			}
-			
-			// check the indirect blocks
-			blocknum = dip[inum].addrs[NDIRECT];
-			if(blocknum >= sb->size || blocknum < 0)
-				throwerr("bad indirect address in inode.");
-
-			int indirectblocknum = blocknum;
-			if(indirectblocknum != 0)
-			{
-				uint *indirectblock = (uint*) getBlock(addr, indirectblocknum); //check for zero entries
-				for(int index = 0; index < NINDIRECT; index++)
-				{
-					if(indirectblock[index] == 0) // empty entry
-						continue;
-					if(indirectblock[index] >= sb->size || indirectblock[index] < 0)
-						throwerr("bad indirect address in inode.");
-				}
-			}
-
+			finishJob(j, FCHECK_ENOMEM, jobLine(j, FCHECK_ENOMEM, "out of memory."));
+			continue;
 		}
+		int result = fcheck_open(ctx, jobs[j].path, &batchopts);
+		if(result == FCHECK_OK)
+			result = fcheck_check(ctx);
 
-		//check 3: Root directory exists, its inode number is 1, and the parent 
-		//of the root directory is itself
-		if(inum == ROOTINO)
+		if(format == FORMAT_NDJSON)
 		{
-			if(dip[inum].type != T_DIR)
-				throwerr("root directory does not exist.");
-
-			bool parentisitself = false;
-			de = (struct dirent *) (addr + (dip[inum].addrs[0])*BLOCK_SIZE);
+			char *out;
+			size_t len;
+			FILE *f = open_memstream(&out, &len);
+			assert(f != NULL);
+			fcheck_ndjson(ctx, f, result);
+			fclose(f);
+			finishJob(j, result, out);
+		}
+		else
+			finishJob(j, result, jobLine(j, result, fcheck_error(ctx)));
+	}
+	fcheck_free(ctx);
+	return NULL;
+}
 
-			n = dip[inum].size/sizeof(struct dirent);
-			for (i = 0; i < n; i++,de++){
-				if(strcmp(de->name, "..") == 0 && de->inum == inum)
-				{
-					parentisitself = true;
-					break;
-				}
-			}
 
-			if(!parentisitself)
-				throwerr("root directory does not exist.");
+// Checks every image on a pool of nthreads threads, one image per thread
+// at a time.
+void runBatch(fcheck_opts *opts, int nthreads)
+{
+	pthread_t *threads;
+	int started = 0;
+
+	batchopts = *opts;
+	batchopts.nthreads = 1;
+	if(nthreads < 1)
+		nthreads = sysconf(_SC_NPROCESSORS_ONLN) > 0 ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
+	if((size_t)nthreads > njobs)
+		nthreads = njobs > 0 ? njobs : 1;
+
+	threads = malloc(nthreads * sizeof(pthread_t));
+	assert(threads != NULL);
+	while(started < nthreads && pthread_create(&threads[started], NULL, batchWorker, NULL) == 0)
+		started++;
+	if(started == 0)
+		batchWorker(NULL);
+	for(int t = 0; t < started; t++)
+		pthread_join(threads[t], NULL);
+	free(threads);
+}
 
-		}
 
-		// check 4: Each directory contains . and .. entries, and the . entry points 
-		// to the directory itself
-		if(dip[inum].type == T_DIR)
+int
+main(int argc, char *argv[])
+{
+	int opt, result;
+	int stats = 0; // 0, STATS_TEXT or STATS_JSON
+	char *listpath = NULL;
+	fcheck_opts opts = {.nthreads = 0}; // 0 until -j
+	fcheck_ctx *ctx;
+	struct option longopts[] = {
+		{"all", no_argument, NULL, 'a'},
+		{"stream", no_argument, NULL, 's'},
+		{"state", required_argument, NULL, 'S'},
+		{"stats", optional_argument, NULL, 't'},
+		{"batch", required_argument, NULL, 'b'},
+		{"repair", no_argument, NULL, 'r'},
+		{"geometry", required_argument, NULL, 'g'},
+		{"format", required_argument, NULL, 'f'},
+		{"level", required_argument, NULL, 'l'},
+		{"mem-limit", required_argument, NULL, 'm'},
+		{NULL, 0, NULL, 0}
+	};
+
+	while((opt = getopt_long(argc, argv, "j:", longopts, NULL)) != -1)
+	{
+		switch(opt)
 		{
-			bool dotfound, doubledotfound, ptstoitself;
-			dotfound = doubledotfound = ptstoitself = false;
-
-			de = (struct dirent *) (addr + (dip[inum].addrs[0])*BLOCK_SIZE); 
-
-			int DPB = BLOCK_SIZE/sizeof(struct dirent); // directory entries per block
-			n = dip[inum].size/sizeof(struct dirent);
-
-			int blockstraversed;
-			bool indblocktraversed = false;
-
-			for (i = 0, blockstraversed = 0; i < n; i++,de++)
-			{
-				if(i % DPB == 0)
-				{
-					blockstraversed++;	
-				}
-				if(!indblocktraversed && blockstraversed > NDIRECT) //encountered the indirect block, switch to the direct block pointers
-				{
-					uint firstblocknum = *(uint*) getBlock(addr, dip[inum].addrs[NDIRECT]);
-					de = (struct dirent *) getBlock(addr, firstblocknum);
-					indblocktraversed = true;
-				}
-				
-				if(strcmp(de->name, "..") == 0)
-				{
-					doubledotfound = true;
-					inodes[inum].parentinode = de->inum;
-				}
-				if(strcmp(de->name, ".") == 0)
-				{
-					dotfound = true;
-					if(de->inum == inum)
-						ptstoitself = true;
-				}
-
-				//check 10: For each inode number that is referred to in a valid directory, 
-				//it is actually marked free
-				if(de->inum != 0 && dip[de->inum].type == 0)
-				{
-					throwerr("inode referred to in directory but marked free.");
-				}
-
-				// Book keeping FOR check 9
-				if(de->inum != 0 && dip[de->inum].type != 0)
-				{
-					if(strcmp(de->name, "..") != 0 && strcmp(de->name, ".") != 0)
-					{
-						inodes[de->inum].refcount++;
-					}
-					if(inum == ROOTINO)
-						inodes[inum].refcount = 1;
-				}
-
-			}
-
-			if(!doubledotfound || !dotfound || !ptstoitself)
-				throwerr("directory not properly formatted.");
-
+		case 'a':
+			opts.all = true;
+			break;
+		case 's':
+			opts.stream = true;
+			break;
+		case 'S':
+			opts.statepath = optarg;
+			break;
+		case 'b':
+			listpath = optarg;
+			break;
+		case 'r':
+			opts.repair = true;
+			break;
+		case 'g':
+		{
+			char *end;
+			opts.bsize = strtoul(optarg, &end, 10);
+			opts.ndirect = *end == ',' ? strtoul(end + 1, &end, 10) : 0;
+			if(*end != '\0' || opts.bsize < 512 || opts.bsize > 4096 || (opts.bsize & (opts.bsize - 1)) != 0 ||
+					(opts.ndirect == 0 && strchr(optarg, ',') != NULL) || opts.ndirect > 32)
+				usage();
+			break;
 		}
-
-		// check 5: For in-use inodes, each block address in use is also marked in use in the bitmap.
-		// for the next check need to mark the blocks used in the block entry
-		
-		// check 7: For in-use inodes, each direct address in use is only used once.
-		// check 8: For in-use inodes, each indirect address in use is only used once.
-
-		if(dip[inum].type != 0)
+		case 'f':
+			if(strcmp(optarg, "text") == 0)
+				format = FORMAT_TEXT;
+			else if(strcmp(optarg, "ndjson") == 0)
+				format = FORMAT_NDJSON;
+			else
+				usage();
+			break;
+		case 'l':
+			if(strcmp(optarg, "quick") == 0)
+				opts.level = FCHECK_QUICK;
+			else if(strcmp(optarg, "normal") == 0)
+				opts.level = FCHECK_NORMAL;
+			else if(strcmp(optarg, "full") == 0)
+				opts.level = FCHECK_FULL;
+			else
+				usage();
+			break;
+		case 'm': // bytes, or with K, M or G
 		{
-			// go through direct blocks
-			for(int b = 0; b < NDIRECT; b++)
-			{
-				 int blocknum = dip[inum].addrs[b]; // data blocknum
-				 if(blocknum == 0) 
-				 	continue;
-				 dblocks[blocknum].usecount++;
-				 dblocks[blocknum].inode = inum;
-				 dblocks[blocknum].type = DIRECTADDR;
-
-				 int bmapblocknum = BBLOCK(blocknum, sb->ninodes);
-				 int bmapbit = blocknum % BPB;
-
-				 char * bmap = addr + (bmapblocknum * BLOCK_SIZE);
-
-				 int m = 1 << (bmapbit % 8);
-				 if((bmap[bmapbit/8] & m) == 0) //bit not set. 
-				 {
-					throwerr("address used by inode but marked free in bitmap.");		
-				 }
-				 else
-				 {
-				 	dblocks[blocknum].bitset = true;
-				 }
-
-				if(dblocks[blocknum].usecount > 1)
-				 	throwerr("direct address used more than once.");
-
-			}
-			
-			// go through the indirect block direct blocks
-			int indirectblocknum = dip[inum].addrs[NDIRECT];
-			
-			if(indirectblocknum != 0)
-			{
-				if(!isBlockUsed(addr, indirectblocknum))
-					throwerr("address used by inode but marked free in bitmap.");
-				
-				dblocks[indirectblocknum].inode = inum;
-				dblocks[indirectblocknum].usecount++;
-				dblocks[indirectblocknum].bitset = true;
-				dblocks[indirectblocknum].type = INDIRECTADDR;
-				if(dblocks[indirectblocknum].usecount > 1)
-				 	throwerr("indirect address used more than once.");
-
-				uint *indirectblock = (uint*) getBlock(addr, indirectblocknum); //check for zero entries
-				for(int index = 0; index < NINDIRECT; index++)
-				{
-					if(indirectblock[index] == 0) // empty entry
-						continue;
-					if(!isBlockUsed(addr, indirectblock[index]))
-					{
-						throwerr("address used by inode but marked free in bitmap.");
-					}
-
-					dblocks[indirectblock[index]].inode = inum;
-					dblocks[indirectblock[index]].usecount++;
-					dblocks[indirectblock[index]].bitset = true;
-					dblocks[indirectblock[index]].type = DIRECTADDR;
-
-					if(dblocks[indirectblock[index]].usecount > 1)
-					{
-				 		throwerr("indirect address used more than once.");
-					}
-
-				}
-			}
-			
+			char *end;
+			unsigned long long limit = strtoull(optarg, &end, 10);
+			int shift = *end == 'K' ? 10 : *end == 'M' ? 20 : *end == 'G' ? 30 : 0;
+			if(shift > 0)
+				end++;
+			if(end == optarg || *end != '\0' || optarg[0] == '-' || limit > (size_t)-1 >> shift)
+				usage();
+			opts.memlimit = (size_t)limit << shift;
+			break;
+		}
+		case 't':
+			if(optarg == NULL || strcmp(optarg, "text") == 0)
+				stats = STATS_TEXT;
+			else if(strcmp(optarg, "json") == 0)
+				stats = STATS_JSON;
+			else
+				usage();
+			break;
+		case 'j':
+			opts.nthreads = atoi(optarg);
+			if(opts.nthreads >= 1)
+				break;
+			// fall through
+		default:
+			usage();
 		}
-
 	}
 
+	if(opts.repair && (opts.level == FCHECK_QUICK || opts.memlimit > 0)) // it needs every check, in memory
+		usage();
 
-	// check 6: For blocks marked in-use in bitmap, the block should actually be in-use in an 
-	// inode or indirect block somewhere
-
-	int bitmapblocknum = 3 + (sb->ninodes/IPB); 
-	int bmcount = sb->nblocks/BPB+1;
-
-	int datablockstart = bitmapblocknum + bmcount;
-
-	for(int bnum = datablockstart; bnum < sb->size; bnum++)
+	// every violation and phase has its record, written through a big
+	// buffer as they can be many
+	if(format == FORMAT_NDJSON)
 	{
-		if(isBlockUsed(addr, bnum) && dblocks[bnum].usecount == 0)
-		{
-			throwerr("bitmap marks block in use but it is not in use.");
-		}
+		opts.all = true;
+		opts.stats = true;
+		setvbuf(stdout, NULL, _IOFBF, 1 << 16);
+	}
 
+	if(listpath != NULL || argc - optind > 1)
+	{
+		if(opts.statepath != NULL || stats || opts.repair) // one image only
+			usage();
+		if(listpath != NULL)
+			readList(listpath);
+		for(int i = optind; i < argc; i++)
+			addJob(argv[i]);
+		runBatch(&opts, opts.nthreads);
+		exit(batchfailed);
 	}
 
-	// check 9: For all inodes marked in use, each must be referred to in at least one directory
-	// check 11: Reference counts (number of links) for regular files match the number of times 
-	// file is referred to in directories (i.e., hard links work correctly).
-	//
-	// check 12: No extra links allowed for directories (each directory only appears in one other 
-	// directory).
+	if(optind >= argc)
+		usage();
+	opts.stats = opts.stats || stats != 0;
 
-	for(int inum = 1; inum < sb->ninodes; inum++)
+	if((ctx = fcheck_new()) == NULL)
 	{
-		if(inodes[inum].inuse && inodes[inum].refcount < 1)
-		{
-			throwerr("inode marked use but not found in a directory.");
-		}
-
-		if(dip[inum].type == T_FILE && dip[inum].nlink != inodes[inum].refcount)
-		{
-			throwerr("bad reference count for file.");
-		}
+		fprintf(stderr, "out of memory.\n");
+		exit(1);
+	}
 
-		if(dip[inum].type == T_DIR && inodes[inum].refcount > 1)
-		{
-			throwerr(" directory appears more than once in file system.");
-		}
+	result = fcheck_open(ctx, argv[optind], &opts);
+	if(result == FCHECK_OK)
+		result = fcheck_check(ctx);
 
-	}
+	if(format == FORMAT_NDJSON)
+		fcheck_ndjson(ctx, stdout, result);
+	else if(result < 0)
+		fprintf(stderr, "%s\n", fcheck_error(ctx));
+	else if(opts.all || opts.repair)
+		fcheck_report(ctx, stderr);
+	else if(result == FCHECK_VIOLATION)
+		fprintf(stderr, "ERROR: %s\n", fcheck_error(ctx));
 
-	exit(0);
+	if(stats && format != FORMAT_NDJSON)
+		fcheck_stats(ctx, stdout, stats == STATS_JSON);
 
+	// fix what was found, then say what is left
+	if(opts.repair && result == FCHECK_VIOLATION)
+	{
+		result = fcheck_repair(ctx, stderr);
+		if(result < 0)
+			fprintf(stderr, "%s\n", fcheck_error(ctx));
+		else if(result == FCHECK_VIOLATION)
+			fprintf(stderr, "ERROR: %s\n", fcheck_error(ctx));
+	}
+	fcheck_free(ctx);
+	exit(result != FCHECK_OK);
 }
-
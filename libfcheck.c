@@ -0,0 +1,4226 @@
+#define _FILE_OFFSET_BITS 64 // images over 2 GB on 32-bit builds too
+
+// The checker behind fcheck, as a library: see libfcheck.h. Everything a
+// check needs lives in its fcheck_ctx, so contexts are independent and each
+// can be reused from one image to the next.
+
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+#include <setjmp.h>
+#include <time.h>
+#include <sys/resource.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+#include "types.h"
+#include "fs.h"
+#include "libfcheck.h"
+
+
+#define T_DIR  1   // Directory
+#define T_FILE 2   // File
+#define T_DEV  3   // Special device
+
+#define DSLICE 32 // directory entries classified at a time
+
+
+// Sizes that follow from the block size and the number of direct addresses
+// of the image. fs.h only has those of xv6 itself, 512 and 12.
+typedef struct Geometry{
+	uint bsize;     // bytes per block
+	uint ndirect;   // direct addresses per inode
+	uint nindirect; // addresses per indirect block
+	uint maxfile;   // blocks per file
+	uint inodesize; // bytes per on-disk inode
+	uint ipb;       // inodes per block
+	uint bpb;       // bitmap bits per block
+	uint dpb;       // directory entries per block
+}Geometry;
+
+#define MINBSIZE 512
+#define MAXBSIZE 4096
+#define MAXNDIRECT 32
+#define GEOMAGIC 0x6d6f6567 // "geom": the superblock says its geometry, see readGeometry()
+
+
+// An on-disk inode. addrs has ndirect + 1 entries, so inodes are
+// geo.inodesize apart rather than sizeof(Dinode).
+typedef struct Dinode{
+	short type;  // File type
+	short major; // Major device number (T_DEV only)
+	short minor; // Minor device number (T_DEV only)
+	short nlink; // Number of links to inode in file system
+	uint size;   // Size of file (bytes)
+	uint addrs[];
+}Dinode;
+
+
+// Per-block checker state. Each field is a bit plane indexed by block number,
+// so the table costs three bits per block and scales to images with tens of
+// millions of blocks. The use count of a block is referenced + shared, which
+// saturates at 2; that is all checks 6, 7 and 8 need to know. The owning inode
+// and address type are not kept since no check reads them back.
+typedef struct Blockstate{
+
+	uint64_t *bitset;     // marked in use in the on-disk bitmap
+	uint64_t *referenced; // use count >= 1
+	uint64_t *shared;     // use count >= 2
+
+}Blockstate;
+
+
+// Per-inode checker state. In-use is just inode(ctx, inum)->type != 0, so only the
+// number of directory entries referring to each inode is stored, plus what
+// the directory pass has seen of each directory so far, and a bit plane of
+// the inodes the tree walk reached from the root. The scan also keeps a bit
+// for each SCREEN inodes with any in use, so the passes after it can skip
+// the empty ones (see nextInode).
+typedef struct Inodestate{
+	uint *refcount;
+	uchar *dirflags;
+	uint64_t *reached;
+	uint64_t *occupied;
+}Inodestate;
+
+#define DIR_DOT        1  // has a . entry
+#define DIR_DOTDOT     2  // has a .. entry
+#define DIR_SELF       4  // its . entry points to itself
+#define DIR_PARENTSELF 8  // its .. entry points to itself
+#define DIR_REFERENCED 16 // has an entry for some inode (root only)
+#define DIR_NAMED      32 // its names went through the directory pass's table (see checkDir)
+#define DIR_SPLIT      64 // and its blocks not all in one run, so they are checked again
+
+
+// Where image contents come from. The mmap backend hands out pointers into
+// the mapped file. The stream backend reads the head of the image (up to the
+// end of the bitmap) in order, then gathers copies of the indirect and
+// directory blocks the checks will read (see gatherBlocks); its blocks are
+// available once that is done.
+typedef struct Image{
+	char *(*head)(fcheck_ctx *ctx, size_t len);     // the first len bytes, or NULL if shorter
+	char *(*block)(fcheck_ctx *ctx, uint blocknum); // one block, or NULL if not available
+	void (*advise)(fcheck_ctx *ctx, uint first, uint last, int advice); // madvise() hint for a run of blocks
+}Image;
+
+#define WINDOW 256 // blocks read at a time by the stream backend
+#define READSIZE (128 << 10) // bytes read by one system call, before the geometry is known too
+#define HEADSTEP (1 << 20)   // bytes the head of a stream grows by at least
+
+#define CHUNK 1024 // inodes a worker claims at a time
+#define SCREEN 64  // inodes screenInodes() decodes at a time
+
+#define NOBLOCK ((uint)-1)
+
+#define RUNBUF 16384   // block numbers read from a run at a time, see Merge
+#define MINSPILL 16384 // block numbers a worker gathers before sorting them, at the least
+#define SORTPLANES (1 << 20)  // bytes of a plane from which sorting the blocks in use may pay, see prefersSort
+#define SORTSHARE 256         // sorting pays with fewer than one block in this many in use
+
+// An inode's addresses as blockMap() decodes them, once for every check
+// that walks them.
+typedef struct Blockmap{
+	uint *addrs;    // the direct addresses, then the indirect block
+	uint *indirect; // the entries of the indirect block, or NULL if it has none or it is out of the image
+}Blockmap;
+
+// Where a walk over the blocks of a directory is, see dirNext(). Holes and
+// blocks out of the image are skipped.
+typedef struct Dircursor{
+	Blockmap bm;
+	uint k;              // index in the directory of the next block
+	uint nblocks;        // blocks its size covers
+	uint nextblock;      // and the number of that block
+	struct dirent *next; // and its contents, or NULL past the last one
+}Dircursor;
+
+// The names of one directory, for check 13: an open-addressing table of
+// names as addNames() packs them into two words, with the generation they
+// were added in where the entry has its inode number. Slots of another
+// generation are empty, so starting on the next directory clears it.
+typedef struct Nametable{
+	uint64_t *slots; // two words a slot
+	uint nslots;     // a power of 2, or 0
+	uint count;      // names of this generation
+	uint gen;        // from 1 to 0xFFFF
+	int inum;        // the directory they are of, or -1
+}Nametable;
+
+// Where the path of an inode goes on from, see fcheck_path(): an entry
+// that names it, as its directory and index there.
+typedef struct Pathlink{
+	uint parent; // the directory, or 0 if none names the inode
+	uint entry;  // the entry's index in the directory
+}Pathlink;
+
+// A block of directory inum, its k-th
+typedef struct Dirblock{
+	uint blocknum;
+	uint inum;
+	uint k;
+}Dirblock;
+
+// A thread of the inode scan. Unless the scan is exact, it notes the blocks
+// of the directories it meets for the directory pass instead of reading them.
+// The same threads do the tree walk, each with a deque of directories to
+// visit: it takes from the tail, the others steal from the head.
+typedef struct Worker{
+	fcheck_ctx *ctx;
+	pthread_t thread;
+	bool exact;
+	Dirblock *dirblocks;
+	size_t ndirblocks, dirblockscap;
+	uint64_t blocksread; // indirect and directory blocks, for stats
+	uint *walkdirs;
+	uint walkhead, walktail, walkcap;
+	pthread_mutex_t walklock;
+	uint *uses;          // blocks used, when they are sorted, and as much again to sort them
+	size_t nuses, usescap;
+}Worker;
+
+// Block numbers in increasing order, in a temporary file or in memory.
+typedef struct Run{
+	FILE *f;      // or NULL
+	uint *blocks; // in memory
+	size_t n;
+}Run;
+
+// A k-way merge of sorted runs of block numbers, a buffer of RUNBUF from
+// each run in a file. The heap has the runs with blocks left, the one with
+// the smallest next block on top.
+typedef struct Merge{
+	Run *runs;
+	uint nruns;
+	uint *buf;
+	uint **at;        // each run's buffer
+	uint *len, *pos;  // block numbers in it, and taken from it
+	uint *heap;
+	uint nheap;
+	size_t cap;       // runs there is room for
+}Merge;
+
+// A violation as collected with opts.all.
+typedef struct Violation{
+	int check;  // check number, as listed in the README
+	int inum;   // inode at fault, or -1
+	uint block; // block at fault, or NOBLOCK
+	char *msg;
+	uint seq;   // order of recording
+}Violation;
+
+#define RINGSIZE 4096 // violations kept for the report
+
+// A directory as the checkpoint keeps it: what the directory pass derived
+// from it, and a digest of the blocks it was derived from.
+typedef struct Dirsummary{
+	uint64_t hash;  // sum of blockDigest() over its blocks
+	uint inum;
+	uint flags;     // DIR_ flags
+	uint ntargets;
+	uint *targets;  // inode of each non-empty entry, | COUNTED if counted for check 9
+}Dirsummary;
+
+#define COUNTED ((uint)1 << 31)
+#define STATEMAGIC "fcheck\0\3"
+
+// What one phase of the run cost, for stats
+typedef struct Phase{
+	const char *name;
+	double seconds;
+	uint64_t bytes;       // of the image and of checker state, as read by the checks
+	long minflt, majflt;  // page faults
+	uint64_t counters[2]; // cycles and cache misses, if perf counters could be opened
+}Phase;
+
+#define MAXPHASES 12
+
+
+// Everything one check works on. Buffers that only depend on the size of
+// the image are kept by fcheck_reset() for the next one; what the checkpoint
+// holds is freed.
+struct fcheck_ctx{
+	fcheck_opts opts;
+	char *imagepath;
+
+	// the image
+	Image image;
+	int imagefd;
+	bool ownfd;       // imagefd was opened by fcheck_open()
+	char *addr;       // the mapped image, for the mmap backend
+	off_t imagesize;
+	bool seekable;    // pread works, otherwise the stream can only be read forward
+	off_t streampos;  // bytes read so far when not seekable
+	char *headbuf;    // the head of the image as read so far
+	size_t headlen;
+
+	uint *stored;     // numbers of the blocks gathered by the stream backend
+	char *storeddata; // and their contents, geo.bsize apart
+	uint nstored, storedcap;
+	size_t storeddatacap;
+	uint *slots;      // open-addressing index into stored: 0 is empty, else index + 1
+	uint nslots;      // a power of 2
+	uint *pending;    // min-heap of blocks still to gather
+	uint npending, pendingcap;
+	char *window;     // WINDOW blocks as read by gatherBlocks
+	size_t windowsize;
+	uint64_t *longdirs;
+	size_t longdirscap;
+
+	struct superblock *sb;
+	Geometry geo;
+	char *itable;     // the inode table
+	void (*scanchunk)(fcheck_ctx *ctx, Worker *w, int start, int end); // the kernel for geo
+
+	// checker state, in one anonymous mapping
+	char *arena;
+	size_t arenasize;
+	Blockstate dblocks;
+	Inodestate inodes;
+
+	// the sort engine (see arenaInit): the blocks inodes use are gathered
+	// in sorted runs and merged, rather than counted in the referenced and
+	// shared planes, and the bitset is the image's bitmap itself. In
+	// external mode, when the planes won't fit in opts.memlimit, the runs
+	// are spilled to temporary files.
+	bool sorted;
+	bool external;
+	size_t spillcap;      // block numbers a worker gathers before it spills them, or at first
+	uint fanin;           // runs merged at once
+	Run *runs;
+	uint nruns, runscap;
+	uint64_t nsorted;     // block numbers in the runs
+	pthread_mutex_t runlock;
+	Merge merge;
+	uint *suspects;       // blocks the runs have more than once, in order, for the exact scan
+	uchar *seen;          // and whether the exact scan met each yet
+	uint nsuspects, suspectscap;
+
+	// the inode scan
+	Worker *workers;
+	int nworkers;
+	Dirblock *dirblocks;  // of all workers, for the directory pass
+	Dirblock *sortbuf;    // and room to sort them
+	size_t dirblockscap;
+	int nextinode;        // start of the next unclaimed chunk
+	int firstbad;         // lowest inode found failing so far
+	char *firsterr;       // and its violation
+	bool collided;        // two shards used the same block
+	bool outofmemory;     // a worker could not grow its dirblocks or deque
+	bool spillfailed;     // or could not write a run
+	uint walkpending;     // directories pushed for the tree walk and not yet visited
+	int nwalkers;         // workers in the tree walk
+	pthread_mutex_t errlock;
+	Nametable names;      // for the directory pass and the exact scan, which are serial
+
+	// violations, with opts.all
+	Violation ring[RINGSIZE]; // the last RINGSIZE violations recorded
+	uint nviolations;         // violations recorded, including overwritten ones
+	uint checkcount[15];      // violations recorded per check, from check 0
+	Pathlink *pathlinks;      // by inode, built once a path is asked for
+	char pathbuf[4096];       // the last path asked for, from its end
+
+	// the checkpoint, with opts.statepath
+	bool incremental;      // a checkpoint for an image of this shape was read
+	Dirsummary *olddirs;   // its directories, by inode
+	uint nolddirs;
+	uint *oldtargets;      // their entries
+	uint *olddir;          // index into olddirs by inode, or NOBLOCK
+	uint *oldrefcount;     // its refcounts
+	uint *mentions;        // entries naming each inode, . and .. included
+	uint64_t *dirhash;     // digest of each directory as the image has it now
+	uint64_t *notes;       // entries of directories checked this run: inum << 32 | target
+	size_t nnotes, notescap;
+
+	// the quick level: the blocks the inodes use, at least and at most, and
+	// the blocks the bitmap marks
+	uint64_t quickcounts[3];
+
+	// repair, with opts.repair
+	bool checked;          // fcheck_check() got through the image
+	bool screened;         // and inodes.occupied is good for the whole inode table
+	uint64_t *dirty;       // blocks the repair changed
+	size_t ndirty, dirtycap;
+	uint nextfree;         // no block below it is free
+
+	// stats, with opts.stats
+	Phase phases[MAXPHASES];
+	int nphases;
+	int counterfd[2];
+	struct timespec phasestart;
+	struct rusage phaseusage;
+	uint64_t phasecounters[2];
+
+	// how the check ended
+	const char *error;
+	char errbuf[256];
+	jmp_buf unwind;       // back to fcheck_check(), from its own thread only
+};
+
+
+static Dinode *inode(fcheck_ctx *ctx, int inum)
+{
+	return (Dinode *) (ctx->itable + (size_t)inum * ctx->geo.inodesize);
+}
+
+
+// First block of the bitmap, and first data block, as laid out by mkfs; the
+// bitmap covers the whole image.
+static uint bitmapStart(fcheck_ctx *ctx)
+{
+	return ctx->sb->ninodes / ctx->geo.ipb + 3;
+}
+
+
+static uint dataStart(fcheck_ctx *ctx)
+{
+	return bitmapStart(ctx) + ctx->sb->size / ctx->geo.bpb + 1;
+}
+
+
+// Ends the check: fcheck_check() returns result, with msg as its error.
+static void fail(fcheck_ctx *ctx, int result, const char *msg)
+{
+	ctx->error = msg;
+	longjmp(ctx->unwind, result);
+}
+
+
+static void imageTooSmall(fcheck_ctx *ctx)
+{
+	fail(ctx, FCHECK_ETOOSMALL, "image too small for its superblock.");
+}
+
+
+static void throwerr(fcheck_ctx *ctx, char *string)
+{
+	fail(ctx, FCHECK_VIOLATION, string);
+}
+
+
+// Ends the check at a failed system call, perror() style.
+static void systemError(fcheck_ctx *ctx, const char *what)
+{
+	snprintf(ctx->errbuf, sizeof(ctx->errbuf), "%s: %s", what, strerror(errno));
+	fail(ctx, FCHECK_ESYS, ctx->errbuf);
+}
+
+
+static void outOfMemory(fcheck_ctx *ctx)
+{
+	fail(ctx, FCHECK_ENOMEM, "out of memory.");
+}
+
+
+// Opens a hardware counter for this process and the threads it starts
+// later: cycles if which is 0, else cache misses.
+static int openCounter(int which)
+{
+#ifdef __linux__
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.config = which == 0 ? PERF_COUNT_HW_CPU_CYCLES : PERF_COUNT_HW_CACHE_MISSES;
+	attr.inherit = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+	return -1;
+#endif
+}
+
+
+static void readCounters(fcheck_ctx *ctx, uint64_t *values)
+{
+	for(int c = 0; c < 2; c++)
+		if(ctx->counterfd[c] < 0 || read(ctx->counterfd[c], &values[c], sizeof(uint64_t)) != sizeof(uint64_t))
+			values[c] = 0;
+}
+
+
+// Ends the current phase, if any, and starts the next. Does nothing without
+// opts.stats.
+static void startPhase(fcheck_ctx *ctx, const char *name)
+{
+	struct timespec now;
+	struct rusage usage;
+	uint64_t counters[2];
+
+	if(!ctx->opts.stats)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	getrusage(RUSAGE_SELF, &usage);
+	readCounters(ctx, counters);
+
+	if(ctx->nphases > 0)
+	{
+		Phase *p = &ctx->phases[ctx->nphases - 1];
+		p->seconds = (now.tv_sec - ctx->phasestart.tv_sec) + (now.tv_nsec - ctx->phasestart.tv_nsec) / 1e9;
+		p->minflt = usage.ru_minflt - ctx->phaseusage.ru_minflt;
+		p->majflt = usage.ru_majflt - ctx->phaseusage.ru_majflt;
+		for(int c = 0; c < 2; c++)
+			p->counters[c] = counters[c] - ctx->phasecounters[c];
+	}
+	if(name != NULL && ctx->nphases < MAXPHASES - 1) // room for the total
+		ctx->phases[ctx->nphases++] = (Phase){.name = name};
+
+	ctx->phasestart = now;
+	ctx->phaseusage = usage;
+	memcpy(ctx->phasecounters, counters, sizeof(counters));
+}
+
+
+// Adds to the bytes the current phase read.
+static void phaseBytes(fcheck_ctx *ctx, uint64_t bytes)
+{
+	if(ctx->opts.stats && ctx->nphases > 0)
+		ctx->phases[ctx->nphases - 1].bytes += bytes;
+}
+
+
+// Starts timing a check. The counters are opened once per context.
+static void statsInit(fcheck_ctx *ctx)
+{
+	if(ctx->counterfd[0] == -2)
+	{
+		ctx->counterfd[0] = openCounter(0);
+		ctx->counterfd[1] = ctx->counterfd[0] >= 0 ? openCounter(1) : -1;
+	}
+	startPhase(ctx, "read");
+}
+
+
+static char *mmapHead(fcheck_ctx *ctx, size_t len)
+{
+	return (off_t)len <= ctx->imagesize ? ctx->addr : NULL;
+}
+
+
+static char *mmapBlock(fcheck_ctx *ctx, uint blocknum)
+{
+	if((off_t)(blocknum + 1) * ctx->geo.bsize > ctx->imagesize)
+		return NULL;
+	return ctx->addr + (off_t)blocknum * ctx->geo.bsize;
+}
+
+
+// Passes an access pattern for blocks first to last on to the kernel, over
+// the whole pages they sit in.
+static void mmapAdvise(fcheck_ctx *ctx, uint first, uint last, int advice)
+{
+	off_t pagesize = sysconf(_SC_PAGESIZE);
+	off_t start = (off_t)first * ctx->geo.bsize / pagesize * pagesize;
+	off_t end = (off_t)(last + 1) * ctx->geo.bsize;
+
+	if(end > ctx->imagesize)
+		end = ctx->imagesize;
+	if(start < end)
+		madvise(ctx->addr + start, end - start, advice);
+}
+
+
+// Reads up to len bytes at offset off, READSIZE bytes at a time, and returns
+// how many were read before the end of the image. Without seeking, off must
+// not be behind what was read already; the bytes up to it are skipped.
+static size_t streamRead(fcheck_ctx *ctx, char *buf, off_t off, size_t len)
+{
+	size_t done = 0;
+
+	while(done < len)
+	{
+		size_t chunk = len - done < READSIZE ? len - done : READSIZE;
+		ssize_t got;
+
+		if(ctx->seekable)
+			got = pread(ctx->imagefd, buf + done, chunk, off + done);
+		else
+		{
+			if(off + (off_t)done < ctx->streampos)
+				return done;
+			while(ctx->streampos < off + (off_t)done)
+			{
+				off_t skip = off + done - ctx->streampos;
+				got = read(ctx->imagefd, buf + done, skip < (off_t)chunk ? skip : (off_t)chunk);
+				if(got <= 0)
+					return done;
+				ctx->streampos += got;
+			}
+			got = read(ctx->imagefd, buf + done, chunk);
+			if(got > 0)
+				ctx->streampos += got;
+		}
+		if(got <= 0)
+			return done;
+		done += got;
+	}
+	return done;
+}
+
+
+// Extends the head of the image read so far to len bytes. This moves it, so
+// earlier pointers into it are stale.
+//
+// len comes from the superblock, so the buffer only grows as far as the
+// image goes: never past the length of a file, and for a pipe by at most
+// what has come in so far, so that it is never much bigger than the data.
+static char *streamHead(fcheck_ctx *ctx, size_t len)
+{
+	if(ctx->imagesize > 0 && len > (size_t)ctx->imagesize)
+		return NULL;
+
+	while(ctx->headlen < len)
+	{
+		size_t want = ctx->headlen < HEADSTEP ? HEADSTEP : 2 * ctx->headlen;
+		if(want > len)
+			want = len;
+		char *buf = realloc(ctx->headbuf, want);
+		if(buf == NULL)
+			return NULL;
+		ctx->headbuf = buf;
+		ctx->headlen += streamRead(ctx, ctx->headbuf + ctx->headlen, ctx->headlen, want - ctx->headlen);
+		if(ctx->headlen < want) // what was read is kept for a shorter head
+			return NULL;
+	}
+	return ctx->headbuf;
+}
+
+
+static uint hashBlock(fcheck_ctx *ctx, uint blocknum)
+{
+	return (blocknum * 2654435761u) & (ctx->nslots - 1);
+}
+
+
+// Returns where block blocknum is in stored, or -1 if it is not there
+static int storeFind(fcheck_ctx *ctx, uint blocknum)
+{
+	if(ctx->nslots == 0)
+		return -1;
+	for(uint h = hashBlock(ctx, blocknum); ctx->slots[h] != 0; h = (h + 1) & (ctx->nslots - 1))
+		if(ctx->stored[ctx->slots[h] - 1] == blocknum)
+			return ctx->slots[h] - 1;
+	return -1;
+}
+
+
+static void storeAdd(fcheck_ctx *ctx, uint blocknum, char *data)
+{
+	if(ctx->nstored == ctx->storedcap)
+	{
+		ctx->storedcap = ctx->storedcap ? 2 * ctx->storedcap : 64;
+		ctx->stored = realloc(ctx->stored, ctx->storedcap * sizeof(uint));
+		if(ctx->stored == NULL)
+			outOfMemory(ctx);
+	}
+	if((size_t)(ctx->nstored + 1) * ctx->geo.bsize > ctx->storeddatacap)
+	{
+		ctx->storeddatacap = ctx->storeddatacap ? 2 * ctx->storeddatacap : 64 * MAXBSIZE;
+		ctx->storeddata = realloc(ctx->storeddata, ctx->storeddatacap);
+		if(ctx->storeddata == NULL)
+			outOfMemory(ctx);
+	}
+	ctx->stored[ctx->nstored] = blocknum;
+	memcpy(ctx->storeddata + (size_t)ctx->nstored * ctx->geo.bsize, data, ctx->geo.bsize);
+	ctx->nstored++;
+
+	if(2 * ctx->nstored > ctx->nslots) // keep the index at most half full
+	{
+		free(ctx->slots);
+		ctx->nslots = ctx->nslots ? 2 * ctx->nslots : 128;
+		ctx->slots = calloc(ctx->nslots, sizeof(uint));
+		if(ctx->slots == NULL)
+			outOfMemory(ctx);
+		for(uint i = 0; i < ctx->nstored; i++)
+		{
+			uint h = hashBlock(ctx, ctx->stored[i]);
+			while(ctx->slots[h] != 0)
+				h = (h + 1) & (ctx->nslots - 1);
+			ctx->slots[h] = i + 1;
+		}
+		return;
+	}
+
+	uint h = hashBlock(ctx, blocknum);
+	while(ctx->slots[h] != 0)
+		h = (h + 1) & (ctx->nslots - 1);
+	ctx->slots[h] = ctx->nstored;
+}
+
+
+// The stream backend has its blocks in memory by the time they are read.
+static void streamAdvise(fcheck_ctx *ctx, uint first, uint last, int advice)
+{
+}
+
+
+static char *streamBlock(fcheck_ctx *ctx, uint blocknum)
+{
+	if((size_t)(blocknum + 1) * ctx->geo.bsize <= ctx->headlen)
+		return ctx->headbuf + (size_t)blocknum * ctx->geo.bsize;
+
+	int i = storeFind(ctx, blocknum);
+	return i < 0 ? NULL : ctx->storeddata + (size_t)i * ctx->geo.bsize;
+}
+
+
+static void pendingPush(fcheck_ctx *ctx, uint blocknum)
+{
+	if(ctx->npending == ctx->pendingcap)
+	{
+		ctx->pendingcap = ctx->pendingcap ? 2 * ctx->pendingcap : 1024;
+		ctx->pending = realloc(ctx->pending, ctx->pendingcap * sizeof(uint));
+		if(ctx->pending == NULL)
+			outOfMemory(ctx);
+	}
+
+	uint i = ctx->npending++;
+	for(; i > 0 && ctx->pending[(i - 1) / 2] > blocknum; i = (i - 1) / 2)
+		ctx->pending[i] = ctx->pending[(i - 1) / 2];
+	ctx->pending[i] = blocknum;
+}
+
+
+static uint pendingPop(fcheck_ctx *ctx)
+{
+	uint top = ctx->pending[0];
+	uint last = ctx->pending[--ctx->npending];
+	uint i = 0;
+
+	for(uint c = 1; c < ctx->npending; i = c, c = 2 * c + 1)
+	{
+		if(c + 1 < ctx->npending && ctx->pending[c + 1] < ctx->pending[c])
+			c++;
+		if(last <= ctx->pending[c])
+			break;
+		ctx->pending[i] = ctx->pending[c];
+	}
+	ctx->pending[i] = last;
+	return top;
+}
+
+
+// Whether blocknum is inside the image
+static bool isValidBlock(fcheck_ctx *ctx, uint blocknum)
+{
+	return blocknum < ctx->sb->size;
+}
+
+
+// Returns a char pointer to the beginning of the specified block number, or
+// NULL if the image doesn't have it
+static char *getBlock(fcheck_ctx *ctx, uint blocknum)
+{
+	if(!isValidBlock(ctx, blocknum))
+		return NULL;
+	return ctx->image.block(ctx, blocknum);
+}
+
+
+// Number of blocks the directory checks walk for directory inum
+static uint dirBlocks(fcheck_ctx *ctx, int inum)
+{
+	uint n = inode(ctx, inum)->size/sizeof(struct dirent);
+	uint nblocks = (n + ctx->geo.dpb - 1) / ctx->geo.dpb;
+
+	return nblocks < ctx->geo.maxfile ? nblocks : ctx->geo.maxfile;
+}
+
+
+// Entries of directory inum in its k-th block
+static uint dirEntries(fcheck_ctx *ctx, int inum, uint k)
+{
+	uint n = inode(ctx, inum)->size/sizeof(struct dirent);
+
+	if(n <= k * ctx->geo.dpb)
+		return 0;
+	return n - k * ctx->geo.dpb < ctx->geo.dpb ? n - k * ctx->geo.dpb : ctx->geo.dpb;
+}
+
+
+static void blockMap(fcheck_ctx *ctx, Dinode *dip, uint ndirect, Blockmap *bm)
+{
+	bm->addrs = dip->addrs;
+	bm->indirect = NULL;
+	if(dip->addrs[ndirect] != 0 && isValidBlock(ctx, dip->addrs[ndirect]))
+		bm->indirect = (uint *) getBlock(ctx, dip->addrs[ndirect]);
+}
+
+
+// Number of the k-th block of an inode as xv6 maps it, or 0 if it has none.
+static uint blockAt(fcheck_ctx *ctx, Blockmap *bm, uint k)
+{
+	if(k < ctx->geo.ndirect)
+		return bm->addrs[k];
+	return bm->indirect != NULL && k < ctx->geo.maxfile ? bm->indirect[k - ctx->geo.ndirect] : 0;
+}
+
+
+// Finds the next block of the cursor's directory from block c->k on that
+// is allocated and can be read, and asks for it to be brought into the
+// cache while the current one is checked.
+static void dirSeek(fcheck_ctx *ctx, Dircursor *c)
+{
+	for(; c->k < c->nblocks; c->k++)
+	{
+		c->nextblock = blockAt(ctx, &c->bm, c->k);
+		if(c->nextblock != 0 && (c->next = (struct dirent *) getBlock(ctx, c->nextblock)) != NULL)
+		{
+			__builtin_prefetch(c->next);
+			return;
+		}
+	}
+	c->next = NULL;
+}
+
+
+static void dirOpen(fcheck_ctx *ctx, int inum, Dircursor *c)
+{
+	blockMap(ctx, inode(ctx, inum), ctx->geo.ndirect, &c->bm);
+	c->k = 0;
+	c->nblocks = dirBlocks(ctx, inum);
+	dirSeek(ctx, c);
+}
+
+
+// The next block of a directory, with its number and its index in the
+// directory, or NULL past the last one.
+static struct dirent *dirNext(fcheck_ctx *ctx, Dircursor *c, uint *blocknum, uint *k)
+{
+	struct dirent *de = c->next;
+
+	if(de == NULL)
+		return NULL;
+	*blocknum = c->nextblock;
+	*k = c->k++;
+	dirSeek(ctx, c);
+	return de;
+}
+
+
+static void record(fcheck_ctx *ctx, int check, int inum, uint block, char *msg)
+{
+	uint seq = __atomic_fetch_add(&ctx->nviolations, 1, __ATOMIC_RELAXED);
+
+	ctx->ring[seq % RINGSIZE] = (Violation){check, inum, block, msg, seq};
+	__atomic_fetch_add(&ctx->checkcount[check], 1, __ATOMIC_RELAXED);
+}
+
+
+static void ringReset(fcheck_ctx *ctx)
+{
+	ctx->nviolations = 0;
+	memset(ctx->checkcount, 0, sizeof(ctx->checkcount));
+}
+
+
+// Forgets the violations recorded after the first n, which are all kept.
+static void ringRewind(fcheck_ctx *ctx, uint n)
+{
+	ringReset(ctx);
+	for(; ctx->nviolations < n; ctx->nviolations++)
+		ctx->checkcount[ctx->ring[ctx->nviolations].check]++;
+}
+
+
+// Reports a violation found while checking inode inum. Returns true if the
+// inode's checks should stop here, which is unless --all is collecting every
+// violation. The lowest such inode is reported once all shards are done.
+static bool inodeViolation(fcheck_ctx *ctx, int check, int inum, uint block, char *msg)
+{
+	if(ctx->opts.all)
+	{
+		record(ctx, check, inum, block, msg);
+		return false;
+	}
+
+	pthread_mutex_lock(&ctx->errlock);
+	if(inum < ctx->firstbad)
+	{
+		ctx->firstbad = inum;
+		ctx->firsterr = msg;
+	}
+	pthread_mutex_unlock(&ctx->errlock);
+	return true;
+}
+
+
+// Reports a violation found after the inode scan; it ends the run unless
+// --all is collecting every violation.
+static void violation(fcheck_ctx *ctx, int check, int inum, uint block, char *msg)
+{
+	if(!ctx->opts.all)
+		throwerr(ctx, msg);
+	record(ctx, check, inum, block, msg);
+}
+
+
+// Orders violations the way the serial scan meets them: the inode scan by
+// inode, then check 6, then checks 9, 11 and 12, then check 14.
+static int phaseOf(int check)
+{
+	if(check == 6)
+		return 1;
+	if(check == 9 || check == 11 || check == 12)
+		return 2;
+	if(check == 14)
+		return 3;
+	return 0;
+}
+
+
+static int cmpViolation(const void *a, const void *b)
+{
+	const Violation *va = a, *vb = b;
+
+	if(phaseOf(va->check) != phaseOf(vb->check))
+		return phaseOf(va->check) - phaseOf(vb->check);
+	if(phaseOf(va->check) == 0 && va->inum != vb->inum)
+		return va->inum < vb->inum ? -1 : 1;
+	return va->seq < vb->seq ? -1 : va->seq > vb->seq;
+}
+
+
+static bool testBit(uint64_t *plane, uint bit)
+{
+	return (plane[bit / 64] >> (bit % 64)) & 1;
+}
+
+
+// Whether len bytes from p, a multiple of 8 and 8-byte aligned, are all
+// zero: whole words ORed together, with no branches so the compiler does it
+// 16 bytes at a time.
+static inline bool isZero(const void *p, size_t len)
+{
+	const uint64_t *word = p;
+	uint64_t any = 0;
+
+	for(size_t i = 0; i < len / 8; i++)
+		any |= word[i];
+	return any == 0;
+}
+
+
+// The first inode from inum on that may be in use, for the passes over the
+// inode table after the scan: the SCREEN inodes at a time that the scan
+// found all free are skipped, if it went through the whole table.
+static int nextInode(fcheck_ctx *ctx, int inum)
+{
+	if(!ctx->screened || inum >= ctx->sb->ninodes || testBit(ctx->inodes.occupied, inum / SCREEN))
+		return inum;
+
+	uint s = inum / SCREEN, last = (ctx->sb->ninodes - 1) / SCREEN;
+	uint64_t word = ctx->inodes.occupied[s / 64] & (~(uint64_t) 0 << (s % 64));
+	while(word == 0 && s / 64 < last / 64)
+	{
+		s = (s / 64 + 1) * 64;
+		word = ctx->inodes.occupied[s / 64];
+	}
+	if(word == 0)
+		return ctx->sb->ninodes;
+	s = s / 64 * 64 + __builtin_ctzll(word);
+	return s * SCREEN > (uint)inum ? (int)(s * SCREEN) : inum;
+}
+
+
+// About how many inodes nextInode() goes through, for stats.
+static uint64_t occupiedInodes(fcheck_ctx *ctx)
+{
+	uint64_t n = 0;
+
+	if(!ctx->screened)
+		return ctx->sb->ninodes;
+	for(size_t w = 0; w <= (size_t)ctx->sb->ninodes / SCREEN / 64; w++)
+		n += __builtin_popcountll(ctx->inodes.occupied[w]);
+	return n * SCREEN < ctx->sb->ninodes ? n * SCREEN : ctx->sb->ninodes;
+}
+
+
+// Whether to sort the blocks in use rather than count them in the planes,
+// with how many the bitmap marks in use. Counting costs copying the bitmap
+// and going through it for check 6 whatever the use, and a cache miss a use
+// once the planes are bigger than the cache; sorting costs about 10ns a use
+// for the radix passes and the merge. On images of 50M to 1G blocks that
+// paid below one block in 200 to 400 in use.
+static bool prefersSort(fcheck_ctx *ctx, char *bitmap, size_t planesize, uint64_t *marked)
+{
+	*marked = 0;
+
+	if(planesize < SORTPLANES || ctx->opts.repair)
+		return false;
+	for(size_t w = 0; w < ctx->sb->size / 64; w++)
+		*marked += __builtin_popcountll(((uint64_t *) bitmap)[w]);
+	return *marked < ctx->sb->size / SORTSHARE;
+}
+
+
+// Carves the block and inode state out of one anonymous mapping sized from
+// the superblock. The mapping is zero filled and only touched pages are
+// backed by memory, so untouched regions of huge images cost nothing. The
+// on-disk bitmap is copied into the bitset plane; both are little-endian bit
+// arrays, block b being bit b%8 of byte b/8.
+//
+// A mapping left by an earlier image is reused if it is big enough; dropping
+// its pages zero fills it again.
+//
+// The blocks in use are sorted instead if the block planes would take the
+// state past opts.memlimit, and the check is external: the mapping only
+// has the inode state, and what is left of the limit goes half to the
+// workers' spill buffers and half to the merge. They are also sorted, in
+// memory, where that is faster (see prefersSort).
+static void arenaInit(fcheck_ctx *ctx, char *bitmap)
+{
+	size_t planesize = ((size_t)ctx->sb->size + 63) / 64 * sizeof(uint64_t);
+	size_t inodeplanesize = ((size_t)ctx->sb->ninodes + 63) / 64 * sizeof(uint64_t);
+	size_t screenplanesize = ((size_t)ctx->sb->ninodes / SCREEN + 64) / 64 * sizeof(uint64_t);
+	size_t inodestatesize = inodeplanesize + screenplanesize + (size_t)ctx->sb->ninodes * (sizeof(uint) + 1);
+
+	ctx->external = ctx->opts.memlimit > 0 && 3 * planesize + inodestatesize > ctx->opts.memlimit;
+	uint64_t marked = 0;
+	ctx->sorted = ctx->external || prefersSort(ctx, bitmap, planesize, &marked);
+	ctx->spillcap = MINSPILL + marked / ctx->opts.nthreads; // in memory, each worker's share of the blocks in use, as a start
+	ctx->fanin = (uint)-1;
+	if(ctx->external)
+	{
+		size_t budget = ctx->opts.memlimit > inodestatesize ? ctx->opts.memlimit - inodestatesize : 0;
+		ctx->spillcap = budget / 2 / ctx->opts.nthreads / (2 * sizeof(uint));
+		if(ctx->spillcap < MINSPILL)
+			ctx->spillcap = MINSPILL;
+		ctx->fanin = budget / 2 / (RUNBUF * sizeof(uint));
+		if(ctx->fanin < 2)
+			ctx->fanin = 2;
+	}
+	size_t arenasize = (ctx->sorted ? 0 : 3 * planesize) + inodestatesize;
+
+	if(arenasize > ctx->arenasize)
+	{
+		if(ctx->arena != NULL)
+			munmap(ctx->arena, ctx->arenasize);
+		ctx->arena = mmap(NULL, arenasize, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (ctx->arena == MAP_FAILED){
+			ctx->arena = NULL;
+			ctx->arenasize = 0;
+			systemError(ctx, "mmap failed");
+		}
+		ctx->arenasize = arenasize;
+	}
+	else
+#ifdef __linux__
+		madvise(ctx->arena, arenasize, MADV_DONTNEED);
+#else
+		memset(ctx->arena, 0, arenasize);
+#endif
+
+	char *arena = ctx->arena;
+
+	if(ctx->sorted) // the bitmap is whole blocks, so whole words; its bits past the last block are left
+	{
+		ctx->dblocks.bitset = (uint64_t *) bitmap;
+		ctx->dblocks.referenced = ctx->dblocks.shared = NULL;
+	}
+	else
+	{
+		ctx->dblocks.bitset = (uint64_t *) arena;
+		ctx->dblocks.referenced = (uint64_t *) (arena + planesize);
+		ctx->dblocks.shared = (uint64_t *) (arena + 2 * planesize);
+		arena += 3 * planesize;
+
+		memcpy(ctx->dblocks.bitset, bitmap, ((size_t)ctx->sb->size + 7) / 8);
+		if(ctx->sb->size % 64 != 0) // bits past the last block
+			ctx->dblocks.bitset[ctx->sb->size / 64] &= ((uint64_t)1 << (ctx->sb->size % 64)) - 1;
+	}
+	ctx->inodes.reached = (uint64_t *) arena;
+	ctx->inodes.occupied = (uint64_t *) (arena + inodeplanesize);
+	ctx->screened = false;
+	ctx->inodes.refcount = (uint *) (arena + inodeplanesize + screenplanesize);
+	ctx->inodes.dirflags = (uchar *) (ctx->inodes.refcount + ctx->sb->ninodes);
+}
+
+
+// Forgets all block uses, refcounts and directory flags, keeping the bitmap copy.
+static void arenaReset(fcheck_ctx *ctx)
+{
+	size_t planesize = ((size_t)ctx->sb->size + 63) / 64 * sizeof(uint64_t);
+
+	if(!ctx->sorted)
+	{
+		memset(ctx->dblocks.referenced, 0, planesize);
+		memset(ctx->dblocks.shared, 0, planesize);
+	}
+	memset(ctx->inodes.reached, 0, ((size_t)ctx->sb->ninodes + 63) / 64 * sizeof(uint64_t));
+	memset(ctx->inodes.refcount, 0, (size_t)ctx->sb->ninodes * sizeof(uint));
+	memset(ctx->inodes.dirflags, 0, ctx->sb->ninodes);
+}
+
+
+static bool isBlockUsed(fcheck_ctx *ctx, int blocknum)
+{
+	return testBit(ctx->dblocks.bitset, blocknum);
+}
+
+
+// Records one more use of a block and returns its use count, saturated at 2.
+// The referenced bit is an atomic test-and-set so shards can race on it.
+static int useBlock(fcheck_ctx *ctx, int blocknum)
+{
+	uint64_t m = (uint64_t)1 << (blocknum % 64);
+
+	if((__atomic_fetch_or(&ctx->dblocks.referenced[blocknum / 64], m, __ATOMIC_RELAXED) & m) == 0)
+		return 1;
+	__atomic_fetch_or(&ctx->dblocks.shared[blocknum / 64], m, __ATOMIC_RELAXED);
+	return 2;
+}
+
+
+// Whether check 5 fails for a block. Unless the scan is exact this is left to
+// the word-wise reconciliation of the referenced plane after the scan.
+static bool isMarkedFree(fcheck_ctx *ctx, int blocknum, bool exact)
+{
+	return exact && !isBlockUsed(ctx, blocknum);
+}
+
+
+// Sorts block numbers with an LSD radix sort, as sortDirblocks() does.
+static void sortBlocks(uint *a, uint *tmp, size_t n)
+{
+	uint *from = a, *to = tmp;
+	size_t count[2048];
+
+	for(int shift = 0; shift < 32; shift += 11)
+	{
+		memset(count, 0, sizeof(count));
+		for(size_t i = 0; i < n; i++)
+			count[(from[i] >> shift) & 2047]++;
+		if(n == 0 || count[(from[0] >> shift) & 2047] == n)
+			continue;
+
+		for(size_t d = 0, pos = 0; d < 2048; d++)
+		{
+			size_t c = count[d];
+			count[d] = pos;
+			pos += c;
+		}
+		for(size_t i = 0; i < n; i++)
+			to[count[(from[i] >> shift) & 2047]++] = from[i];
+
+		uint *t = from;
+		from = to;
+		to = t;
+	}
+
+	if(from != a)
+		memcpy(a, from, n * sizeof(uint));
+}
+
+
+static void addRun(fcheck_ctx *ctx, Run run)
+{
+	if(ctx->nruns == ctx->runscap)
+	{
+		uint cap = ctx->runscap ? 2 * ctx->runscap : 64;
+		Run *runs = realloc(ctx->runs, cap * sizeof(Run));
+		if(runs == NULL)
+		{
+			if(run.f != NULL)
+				fclose(run.f);
+			__atomic_store_n(&ctx->outofmemory, true, __ATOMIC_RELAXED);
+			return;
+		}
+		ctx->runs = runs;
+		ctx->runscap = cap;
+	}
+	ctx->runs[ctx->nruns++] = run;
+	ctx->nsorted += run.n;
+}
+
+
+// Sorts the blocks a worker gathered and writes them out as a run. On a
+// worker's thread, so failures are only noted; checkInodes() gives up after
+// the scan.
+static void spillRun(fcheck_ctx *ctx, Worker *w)
+{
+	FILE *f;
+
+	sortBlocks(w->uses, w->uses + w->usescap, w->nuses);
+	if((f = tmpfile()) == NULL || fwrite(w->uses, sizeof(uint), w->nuses, f) != w->nuses)
+	{
+		if(f != NULL)
+			fclose(f);
+		__atomic_store_n(&ctx->spillfailed, true, __ATOMIC_RELAXED);
+	}
+	else
+	{
+		pthread_mutex_lock(&ctx->runlock);
+		addRun(ctx, (Run){f, NULL, w->nuses});
+		pthread_mutex_unlock(&ctx->runlock);
+	}
+	w->nuses = 0;
+}
+
+
+// Makes room for more blocks in a worker's buffer: spills it in external
+// mode, else doubles it. As spillRun(), failures are only noted.
+static void moreUses(fcheck_ctx *ctx, Worker *w)
+{
+	if(ctx->external)
+	{
+		spillRun(ctx, w);
+		return;
+	}
+
+	uint *uses = realloc(w->uses, 4 * w->usescap * sizeof(uint));
+	if(uses == NULL)
+	{
+		__atomic_store_n(&ctx->outofmemory, true, __ATOMIC_RELAXED);
+		w->nuses = 0; // the check ends after the scan anyway
+		return;
+	}
+	w->uses = uses;
+	w->usescap *= 2;
+}
+
+
+// Ends a worker's part of the scan, when blocks are sorted: its last
+// blocks are spilled in external mode, else sorted in place to make its run.
+static void finishUses(fcheck_ctx *ctx, Worker *w)
+{
+	if(ctx->external && w->nuses > 0)
+		spillRun(ctx, w);
+	else if(!ctx->external)
+		sortBlocks(w->uses, w->uses + w->usescap, w->nuses);
+}
+
+
+static void closeRuns(fcheck_ctx *ctx)
+{
+	for(uint r = 0; r < ctx->nruns; r++)
+		if(ctx->runs[r].f != NULL)
+			fclose(ctx->runs[r].f);
+	ctx->nruns = 0;
+	ctx->nsorted = 0;
+	ctx->nsuspects = 0;
+}
+
+
+static uint mergeKey(Merge *m, uint r)
+{
+	return m->at[r][m->pos[r]];
+}
+
+
+static void mergeSift(Merge *m, uint i)
+{
+	for(;;)
+	{
+		uint least = i, l = 2 * i + 1, r = 2 * i + 2;
+		if(l < m->nheap && mergeKey(m, m->heap[l]) < mergeKey(m, m->heap[least]))
+			least = l;
+		if(r < m->nheap && mergeKey(m, m->heap[r]) < mergeKey(m, m->heap[least]))
+			least = r;
+		if(least == i)
+			return;
+		uint t = m->heap[i];
+		m->heap[i] = m->heap[least];
+		m->heap[least] = t;
+		i = least;
+	}
+}
+
+
+// Refills the buffer of run r, which is all of it for a run in memory.
+static bool mergeFill(Merge *m, uint r, bool first)
+{
+	Run *run = &m->runs[r];
+
+	m->pos[r] = 0;
+	if(run->f == NULL)
+		m->len[r] = first ? run->n : 0;
+	else
+		m->len[r] = fread(m->at[r], sizeof(uint), RUNBUF, run->f);
+	return m->len[r] > 0;
+}
+
+
+// Starts merging n runs from their beginnings.
+static void mergeOpen(fcheck_ctx *ctx, Run *runs, uint n)
+{
+	Merge *m = &ctx->merge;
+
+	if(n > m->cap)
+	{
+		free(m->buf);
+		free(m->at);
+		free(m->len);
+		m->cap = n;
+		m->buf = malloc(n * RUNBUF * sizeof(uint));
+		m->at = malloc(n * sizeof(uint *));
+		m->len = malloc(3 * n * sizeof(uint));
+		if(m->buf == NULL || m->at == NULL || m->len == NULL)
+		{
+			m->cap = 0;
+			outOfMemory(ctx);
+		}
+	}
+	m->pos = m->len + n;
+	m->heap = m->len + 2 * n;
+	m->runs = runs;
+	m->nruns = n;
+	m->nheap = 0;
+	for(uint r = 0; r < n; r++)
+	{
+		m->at[r] = runs[r].f != NULL ? m->buf + (size_t)r * RUNBUF : runs[r].blocks;
+		if(runs[r].f != NULL)
+			rewind(runs[r].f);
+		if(mergeFill(m, r, true))
+			m->heap[m->nheap++] = r;
+	}
+	for(uint i = m->nheap / 2; i-- > 0; )
+		mergeSift(m, i);
+}
+
+
+// The next block number of the merge, in increasing order, or NOBLOCK past
+// the last.
+static uint mergeNext(fcheck_ctx *ctx)
+{
+	Merge *m = &ctx->merge;
+
+	if(m->nheap == 0)
+		return NOBLOCK;
+	uint r = m->heap[0];
+	uint blocknum = mergeKey(m, r);
+	if(++m->pos[r] == m->len[r] && !mergeFill(m, r, false))
+		m->heap[0] = m->heap[--m->nheap];
+	mergeSift(m, 0);
+	return blocknum;
+}
+
+
+static void mergeClose(fcheck_ctx *ctx)
+{
+	for(uint r = 0; r < ctx->merge.nruns; r++)
+		if(ctx->merge.runs[r].f != NULL && ferror(ctx->merge.runs[r].f))
+			systemError(ctx, "can't read a run file");
+	phaseBytes(ctx, ctx->nsorted * sizeof(uint));
+}
+
+
+// Merges the runs fanin at a time until there are no more than fanin, in
+// external mode.
+static void compactRuns(fcheck_ctx *ctx)
+{
+	uint buf[RUNBUF];
+
+	while(ctx->nruns > ctx->fanin)
+	{
+		Run *runs = ctx->runs;
+		uint nruns = ctx->nruns;
+
+		ctx->runs = NULL;
+		ctx->nruns = ctx->runscap = 0;
+		ctx->nsorted = 0;
+		for(uint first = 0; first < nruns; first += ctx->fanin)
+		{
+			uint n = nruns - first < ctx->fanin ? nruns - first : ctx->fanin;
+			FILE *f = tmpfile();
+			size_t len = 0, total = 0;
+
+			if(f == NULL)
+				systemError(ctx, "can't make a run file");
+			for(uint r = first; r < first + n; r++)
+				total += runs[r].n;
+			addRun(ctx, (Run){f, NULL, total});
+			if(ctx->outofmemory)
+				outOfMemory(ctx);
+			mergeOpen(ctx, runs + first, n);
+			for(uint blocknum; (blocknum = mergeNext(ctx)) != NOBLOCK; )
+			{
+				buf[len++] = blocknum;
+				if(len == RUNBUF || ctx->merge.nheap == 0)
+				{
+					if(fwrite(buf, sizeof(uint), len, f) != len)
+						systemError(ctx, "can't write a run file");
+					len = 0;
+				}
+			}
+			mergeClose(ctx);
+			for(uint r = first; r < first + n; r++)
+				fclose(runs[r].f);
+		}
+		free(runs);
+	}
+}
+
+
+// Goes through the runs after a scan that wasn't exact, as
+// hasMarkedFreeBlocks() and the collisions do through the planes. Returns
+// false if a block is used twice or used but marked free. The blocks used
+// twice are kept for the exact scan, as far as a memory limit goes.
+static bool isUseConsistent(fcheck_ctx *ctx)
+{
+	bool ok = true;
+	uint last = NOBLOCK;
+
+	compactRuns(ctx);
+	mergeOpen(ctx, ctx->runs, ctx->nruns);
+	for(uint blocknum; (blocknum = mergeNext(ctx)) != NOBLOCK; last = blocknum)
+	{
+		if(blocknum != last)
+		{
+			ok = ok && isBlockUsed(ctx, blocknum);
+			continue;
+		}
+		ok = false;
+		if(ctx->nsuspects > 0 && ctx->suspects[ctx->nsuspects - 1] == blocknum)
+			continue;
+		if(ctx->nsuspects == ctx->suspectscap)
+		{
+			if(ctx->external && (size_t)ctx->suspectscap * (sizeof(uint) + 1) > ctx->opts.memlimit / 2)
+				fail(ctx, FCHECK_ENOMEM, "more blocks used twice than --mem-limit has room for.");
+			ctx->suspectscap = ctx->suspectscap ? 2 * ctx->suspectscap : 1024;
+			ctx->suspects = realloc(ctx->suspects, ctx->suspectscap * sizeof(uint));
+			ctx->seen = realloc(ctx->seen, ctx->suspectscap);
+			if(ctx->suspects == NULL || ctx->seen == NULL)
+				outOfMemory(ctx);
+		}
+		ctx->seen[ctx->nsuspects] = 0;
+		ctx->suspects[ctx->nsuspects++] = blocknum;
+	}
+	mergeClose(ctx);
+	return ok;
+}
+
+
+// Whether the exact scan met a block of the runs' suspects before.
+static bool wasSeen(fcheck_ctx *ctx, uint blocknum)
+{
+	uint lo = 0, hi = ctx->nsuspects;
+
+	while(lo < hi)
+	{
+		uint mid = lo + (hi - lo) / 2;
+		if(ctx->suspects[mid] < blocknum)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if(lo == ctx->nsuspects || ctx->suspects[lo] != blocknum)
+		return false;
+	bool seen = ctx->seen[lo];
+	ctx->seen[lo] = 1;
+	return seen;
+}
+
+
+// Whether a block was already used when checks 7 and 8 reach it. Concurrent
+// shards can't tell which of two users of a block the serial scan meets
+// second, so unless the scan is exact a clash is only noted in 'collided'.
+//
+// When blocks are sorted the scan that isn't exact only gathers the block,
+// and the exact one can only have met it before if the runs have it twice.
+static bool isReused(fcheck_ctx *ctx, Worker *w, uint blocknum)
+{
+	if(ctx->sorted && w->exact)
+		return wasSeen(ctx, blocknum);
+	if(ctx->sorted)
+	{
+		if(w->nuses == w->usescap)
+			moreUses(ctx, w);
+		w->uses[w->nuses++] = blocknum;
+		return false;
+	}
+
+	if(useBlock(ctx, blocknum) == 1)
+		return false;
+	if(w->exact)
+		return true;
+	__atomic_store_n(&ctx->collided, true, __ATOMIC_RELAXED);
+	return false;
+}
+
+
+static int cmpU64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+
+// For the stream backend: reads the indirect blocks of in-use inodes and the
+// blocks of directories, in increasing block order, WINDOW blocks at a time.
+// Directories longer than NDIRECT blocks go on through their indirect block,
+// so those blocks join the queue once it is read. A stream that can't seek
+// can't go back for such a block if it comes before its indirect block, and
+// the check fails.
+static void gatherBlocks(fcheck_ctx *ctx)
+{
+	uint wstart = 0, wlen = 0; // blocks in the window
+	uint nlongdirs = 0;        // directories longer than NDIRECT blocks
+
+	if(ctx->windowsize < WINDOW * ctx->geo.bsize)
+	{
+		free(ctx->window);
+		ctx->windowsize = 0;
+		if((ctx->window = malloc(WINDOW * ctx->geo.bsize)) == NULL)
+			outOfMemory(ctx);
+		ctx->windowsize = WINDOW * ctx->geo.bsize;
+	}
+	char *window = ctx->window;
+	for(int inum = 0; inum < ctx->sb->ninodes; inum++)
+	{
+		short type = inode(ctx, inum)->type;
+		if(type != T_DIR && type != T_FILE && type != T_DEV)
+			continue;
+
+		if(inode(ctx, inum)->addrs[ctx->geo.ndirect] != 0 && isValidBlock(ctx, inode(ctx, inum)->addrs[ctx->geo.ndirect]))
+			pendingPush(ctx, inode(ctx, inum)->addrs[ctx->geo.ndirect]);
+		if(type != T_DIR)
+			continue;
+
+		for(uint k = 0; k < dirBlocks(ctx, inum) && k < ctx->geo.ndirect; k++)
+			if(inode(ctx, inum)->addrs[k] != 0 && isValidBlock(ctx, inode(ctx, inum)->addrs[k]))
+				pendingPush(ctx, inode(ctx, inum)->addrs[k]);
+		if(dirBlocks(ctx, inum) > ctx->geo.ndirect && inode(ctx, inum)->addrs[ctx->geo.ndirect] != 0)
+		{
+			if(nlongdirs == ctx->longdirscap)
+			{
+				ctx->longdirscap = ctx->longdirscap ? 2 * ctx->longdirscap : 64;
+				ctx->longdirs = realloc(ctx->longdirs, ctx->longdirscap * sizeof(uint64_t));
+				if(ctx->longdirs == NULL)
+					outOfMemory(ctx);
+			}
+			ctx->longdirs[nlongdirs++] = (uint64_t)inode(ctx, inum)->addrs[ctx->geo.ndirect] << 32 | inum;
+		}
+	}
+	uint64_t *longdirs = ctx->longdirs; // indirect block << 32 | inode, sorted
+	if(nlongdirs > 0)
+		qsort(longdirs, nlongdirs, sizeof(uint64_t), cmpU64);
+
+	while(ctx->npending > 0)
+	{
+		uint blocknum = pendingPop(ctx);
+		if(streamBlock(ctx, blocknum) == NULL) // else in the head, or gathered already
+		{
+			if(blocknum < wstart || blocknum >= wstart + wlen)
+			{
+				if(!ctx->seekable && (off_t)blocknum * ctx->geo.bsize < ctx->streampos)
+				{
+					snprintf(ctx->errbuf, sizeof(ctx->errbuf), "can't go back for block %u in a stream that can't seek.", blocknum);
+					fail(ctx, FCHECK_ESYS, ctx->errbuf);
+				}
+				uint want = ctx->sb->size - blocknum < WINDOW ? ctx->sb->size - blocknum : WINDOW;
+				wstart = blocknum;
+				wlen = streamRead(ctx, window, (off_t)blocknum * ctx->geo.bsize, want * ctx->geo.bsize) / ctx->geo.bsize;
+				if(wlen == 0)
+					continue; // past the end of the image
+			}
+			storeAdd(ctx, blocknum, window + (blocknum - wstart) * ctx->geo.bsize);
+		}
+
+		uint lo = 0, hi = nlongdirs;
+		while(lo < hi) // first directory with an indirect block >= blocknum
+		{
+			uint mid = (lo + hi) / 2;
+			if(longdirs[mid] >> 32 < blocknum)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		for(uint d = lo; d < nlongdirs && longdirs[d] >> 32 == blocknum; d++)
+		{
+			int inum = (uint) longdirs[d];
+			Blockmap bm;
+			if(inum == -1) // done the first time its indirect block came up
+				continue;
+			blockMap(ctx, inode(ctx, inum), ctx->geo.ndirect, &bm);
+			for(uint k = ctx->geo.ndirect; k < dirBlocks(ctx, inum); k++)
+				if(blockAt(ctx, &bm, k) != 0 && isValidBlock(ctx, blockAt(ctx, &bm, k)))
+					pendingPush(ctx, blockAt(ctx, &bm, k));
+			longdirs[d] |= 0xFFFFFFFF;
+		}
+	}
+}
+
+
+// What the first n entries of a directory block are, as bit masks with
+// entry e at bit e, and their inode numbers. Every entry is classified from
+// one 8-byte load of its inode number and start of name, without branches,
+// so the compiler can do several entries at a time.
+typedef struct Dirscan{
+	uint32_t used;   // inum is not 0
+	uint32_t dot;    // named "."
+	uint32_t dotdot; // named ".."
+	uint32_t self;   // points to the directory itself
+	ushort inum[DSLICE];
+}Dirscan;
+
+static void scanDirBlock(int inum, struct dirent *de, uint n, Dirscan *ds)
+{
+	uint32_t used = 0, dot = 0, dotdot = 0, self = 0;
+
+	for(uint e = 0; e < n; e++)
+	{
+		uint64_t head; // little-endian: inum, then name[0], name[1], ...
+		memcpy(&head, &de[e], sizeof(head));
+
+		ushort entryinum = head & 0xFFFF;
+		ds->inum[e] = entryinum;
+		used |= (uint32_t)(entryinum != 0) << e;
+		dot |= (uint32_t)((head >> 16 & 0xFFFF) == '.') << e;
+		dotdot |= (uint32_t)((head >> 16 & 0xFFFFFF) == ('.' << 8 | '.')) << e;
+		self |= (uint32_t)(entryinum == inum) << e;
+	}
+	ds->used = used;
+	ds->dot = dot;
+	ds->dotdot = dotdot;
+	ds->self = self;
+}
+
+
+// Checks n entries of a block of directory inum and notes what they are in
+// flags. Does the book keeping for check 9 and returns the entries failing
+// check 10, as a mask. The classification is left in scan unless NULL.
+static uint32_t checkDirBlock(fcheck_ctx *ctx, int inum, struct dirent *de, uint n, uchar *flags, Dirscan *scan)
+{
+	Dirscan ds;
+	uint32_t bad = 0;
+
+	scanDirBlock(inum, de, n, &ds);
+	if(ds.dot)
+		*flags |= DIR_DOT;
+	if(ds.dot & ds.self)
+		*flags |= DIR_SELF;
+	if(ds.dotdot)
+		*flags |= DIR_DOTDOT;
+	if(ds.dotdot & ds.self)
+		*flags |= DIR_PARENTSELF;
+
+	//check 10: For each inode number that is referred to in a valid directory, 
+	//it is actually marked free
+	for(uint32_t m = ds.used; m != 0; m &= m - 1)
+	{
+		uint e = __builtin_ctz(m);
+		if(ds.inum[e] >= ctx->sb->ninodes || inode(ctx, ds.inum[e])->type == 0)
+			bad |= (uint32_t)1 << e;
+	}
+
+	// Book keeping FOR check 9. The root counts once as referenced by
+	// itself instead of by whatever entries the root (or inode 0 ahead
+	// of it) has for it, so refcounts can be added up in any order.
+	for(uint32_t m = ds.used & ~bad & ~ds.dot & ~ds.dotdot; m != 0; m &= m - 1)
+	{
+		ushort target = ds.inum[__builtin_ctz(m)];
+		if(target != ROOTINO || inum > ROOTINO)
+			__atomic_fetch_add(&ctx->inodes.refcount[target], 1, __ATOMIC_RELAXED);
+	}
+	if(inum == ROOTINO && (ds.used & ~bad) != 0)
+		*flags |= DIR_REFERENCED;
+
+	if(scan != NULL)
+		*scan = ds;
+	return bad;
+}
+
+
+// Finishes directory inum once all its blocks went through checkDirBlock().
+// Returns false if check 4 fails.
+static bool isDirFormatted(fcheck_ctx *ctx, int inum, uchar flags)
+{
+	if(flags & DIR_REFERENCED)
+		__atomic_fetch_add(&ctx->inodes.refcount[ROOTINO], 1, __ATOMIC_RELAXED);
+
+	return (flags & (DIR_DOT | DIR_DOTDOT | DIR_SELF)) == (DIR_DOT | DIR_DOTDOT | DIR_SELF);
+}
+
+
+// Starts the names of directory inum, forgetting those of the last one.
+static void namesReset(Nametable *nt, int inum)
+{
+	nt->inum = inum;
+	nt->count = 0;
+	if(++nt->gen > 0xFFFF)
+	{
+		if(nt->nslots > 0)
+			memset(nt->slots, 0, nt->nslots * 2 * sizeof(uint64_t));
+		nt->gen = 1;
+	}
+}
+
+
+// Adds a packed name to a table of mask + 1 slots. Returns true if it was
+// there already.
+static bool nameInsert(uint64_t *slots, uint mask, uint64_t lo, uint64_t hi)
+{
+	uint64_t h = (lo ^ hi * 0x9E3779B97F4A7C15ull) * 0xC2B2AE3D27D4EB4Full;
+
+	for(uint i = (h >> 32) & mask; ; i = (i + 1) & mask)
+	{
+		uint64_t *slot = slots + 2 * i;
+		if((slot[0] & 0xFFFF) != (lo & 0xFFFF))
+		{
+			slot[0] = lo;
+			slot[1] = hi;
+			return false;
+		}
+		if(slot[0] == lo && slot[1] == hi)
+			return true;
+	}
+}
+
+
+static void namesGrow(fcheck_ctx *ctx, Nametable *nt)
+{
+	uint nslots = nt->nslots ? 2 * nt->nslots : 64;
+	uint64_t *slots = calloc(nslots, 2 * sizeof(uint64_t));
+
+	if(slots == NULL)
+		outOfMemory(ctx);
+	for(uint i = 0; i < nt->nslots; i++)
+		if((nt->slots[2 * i] & 0xFFFF) == nt->gen)
+			nameInsert(slots, nslots - 1, nt->slots[2 * i], nt->slots[2 * i + 1]);
+	free(nt->slots);
+	nt->slots = slots;
+	nt->nslots = nslots;
+}
+
+
+// check 13: adds the names of the entries in 'used', out of a slice of a
+// directory block, to those of the directory, and returns the entries whose
+// name it already had, as a mask. Names are compared as namecmp() in xv6
+// does, up to the first NUL, and entries with no name are left out.
+static uint32_t addNames(fcheck_ctx *ctx, Nametable *nt, struct dirent *de, uint32_t used)
+{
+	const uint64_t ones = 0x0101010101010101ull, highs = 0x8080808080808080ull;
+	uint32_t dup = 0;
+
+	while(nt->count + DSLICE > nt->nslots / 2)
+		namesGrow(ctx, nt);
+
+	for(uint32_t m = used; m != 0; m &= m - 1)
+	{
+		uint e = __builtin_ctz(m);
+		uint64_t w[2]; // little-endian: inum, name[0] to name[5]; then name[6] to name[13]
+		memcpy(w, &de[e], sizeof(w));
+
+		// clear the bytes from the first NUL of the name on
+		uint64_t lo = w[0] | 0xFFFF, hi = w[1];
+		uint64_t zero = (lo - ones) & ~lo & highs;
+		if(zero != 0)
+		{
+			lo &= ~(~(uint64_t)0 << (__builtin_ctzll(zero) & ~7));
+			hi = 0;
+		}
+		else if((zero = (hi - ones) & ~hi & highs) != 0)
+			hi &= ~(~(uint64_t)0 << (__builtin_ctzll(zero) & ~7));
+		lo &= ~(uint64_t)0xFFFF;
+
+		if(lo == 0)
+			continue;
+		if(nameInsert(nt->slots, nt->nslots - 1, lo | nt->gen, hi))
+			dup |= (uint32_t)1 << e;
+		else
+			nt->count++;
+	}
+	return dup;
+}
+
+
+static void addDirblock(fcheck_ctx *ctx, Worker *w, uint blocknum, int inum, uint k)
+{
+	if(w->ndirblocks == w->dirblockscap)
+	{
+		w->dirblockscap = w->dirblockscap ? 2 * w->dirblockscap : 1024;
+		Dirblock *dirblocks = realloc(w->dirblocks, w->dirblockscap * sizeof(Dirblock));
+		if(dirblocks == NULL) // the scan goes on; checkInodes() gives up after it
+		{
+			w->dirblockscap = w->ndirblocks;
+			__atomic_store_n(&ctx->outofmemory, true, __ATOMIC_RELAXED);
+			return;
+		}
+		w->dirblocks = dirblocks;
+	}
+	w->dirblocks[w->ndirblocks++] = (Dirblock){blocknum, inum, k};
+}
+
+
+// Sorts directory blocks by block number with an LSD radix sort, 11 bits a
+// pass, using tmp for n more. Passes where every block has the same digit
+// are skipped.
+static void sortDirblocks(Dirblock *a, Dirblock *tmp, size_t n)
+{
+	Dirblock *from = a, *to = tmp;
+	size_t count[2048];
+
+	for(int shift = 0; shift < 32; shift += 11)
+	{
+		memset(count, 0, sizeof(count));
+		for(size_t i = 0; i < n; i++)
+			count[(from[i].blocknum >> shift) & 2047]++;
+		if(n == 0 || count[(from[0].blocknum >> shift) & 2047] == n)
+			continue;
+
+		for(size_t d = 0, pos = 0; d < 2048; d++)
+		{
+			size_t c = count[d];
+			count[d] = pos;
+			pos += c;
+		}
+		for(size_t i = 0; i < n; i++)
+			to[count[(from[i].blocknum >> shift) & 2047]++] = from[i];
+
+		Dirblock *t = from;
+		from = to;
+		to = t;
+	}
+
+	if(from != a)
+		memcpy(a, from, n * sizeof(Dirblock));
+}
+
+
+static uint64_t mix(uint64_t h, uint64_t w)
+{
+	h = (h ^ w) * 0x9E3779B97F4A7C15ull;
+	return h ^ h >> 29;
+}
+
+
+// 64-bit digest of len bytes, len a multiple of 8, continuing from h. The
+// words go to four lanes in turn, so that each multiply needn't wait for
+// the one before; the lanes are folded at the end.
+static uint64_t digest(uint64_t h, const void *data, size_t len)
+{
+	const char *p = data;
+	uint64_t lane[4] = {h, h ^ 1, h ^ 2, h ^ 3};
+	size_t i = 0;
+
+	for(; i + 32 <= len; i += 32)
+		for(int l = 0; l < 4; l++)
+		{
+			uint64_t w;
+			memcpy(&w, p + i + 8 * l, sizeof(w));
+			lane[l] = mix(lane[l], w);
+		}
+	for(; i < len; i += 8)
+	{
+		uint64_t w;
+		memcpy(&w, p + i, sizeof(w));
+		lane[0] = mix(lane[0], w);
+	}
+	return mix(mix(mix(lane[0], lane[1]), lane[2]), lane[3]);
+}
+
+
+// Digest of the k-th block of directory inum. A directory's digest is the
+// sum over its blocks, so it can be added up in disk order.
+static uint64_t blockDigest(fcheck_ctx *ctx, int inum, uint blocknum, uint k, struct dirent *de)
+{
+	uint n = dirEntries(ctx, inum, k);
+
+	return digest((uint64_t)blocknum << 32 | k << 9 | n, de, n * sizeof(struct dirent));
+}
+
+
+// What the checks read, digested in three parts for the checkpoint: the
+// superblock, inode table and bitmap, which are read together; the indirect
+// blocks of the inodes in use; and the blocks of the directories, summed
+// from blockDigest() as the directory pass does.
+#define NDIGESTS 3
+
+// The head is digested MINBSIZE bytes at a time, keyed by where they are,
+// and the runs that are all zero are left out: most of a big inode table is.
+static uint64_t headDigest(fcheck_ctx *ctx)
+{
+	size_t bitmaplen = ((size_t)ctx->sb->size + 7) / 8;
+	size_t end = (size_t)bitmapStart(ctx) * ctx->geo.bsize + (bitmaplen + ctx->geo.bsize - 1) / ctx->geo.bsize * ctx->geo.bsize;
+	const char *head = (const char *) ctx->sb;
+	uint64_t h = 0;
+
+	phaseBytes(ctx, end - ctx->geo.bsize);
+	for(size_t off = 0; off < end - ctx->geo.bsize; off += MINBSIZE)
+		if(!isZero(head + off, MINBSIZE))
+			h += digest(off, head + off, MINBSIZE);
+	return h;
+}
+
+
+// The indirect blocks' part and, unless the directory pass has summed it in
+// ctx->dirhash already, the directories', in one pass over the inodes,
+// SCREEN at a time where they are all zero.
+static void blocksDigest(fcheck_ctx *ctx, uint64_t *digests, bool withdirs)
+{
+	for(int inum = nextInode(ctx, 0); inum < ctx->sb->ninodes; inum = nextInode(ctx, inum + 1))
+	{
+		if(inum % SCREEN == 0 && inum + SCREEN <= ctx->sb->ninodes &&
+				isZero(inode(ctx, inum), SCREEN * ctx->geo.inodesize))
+		{
+			inum += SCREEN - 1;
+			continue;
+		}
+
+		Dinode *dip = inode(ctx, inum);
+		uint blocknum = dip->addrs[ctx->geo.ndirect];
+		char *block;
+		if(dip->type != 0 && blocknum != 0 && (block = getBlock(ctx, blocknum)) != NULL)
+			digests[1] += digest(blocknum, block, ctx->geo.bsize);
+
+		if(withdirs && dip->type == T_DIR && isValidBlock(ctx, dip->addrs[0]))
+		{
+			Dircursor c;
+			struct dirent *de;
+			uint k;
+
+			dirOpen(ctx, inum, &c);
+			while((de = dirNext(ctx, &c, &blocknum, &k)) != NULL)
+				digests[2] += blockDigest(ctx, inum, blocknum, k, de);
+		}
+	}
+}
+
+
+// Whether the image is the one a checkpoint with these digests was written
+// for. The blocks are only digested if the head matched.
+static bool isUnchanged(fcheck_ctx *ctx, const uint64_t *digests)
+{
+	uint64_t now[NDIGESTS] = {headDigest(ctx), 0, 0};
+
+	if(now[0] != digests[0])
+		return false;
+	blocksDigest(ctx, now, true);
+	return memcmp(now, digests, sizeof(now)) == 0;
+}
+
+
+// Whether directory inum is not in the checkpoint as it is now.
+static bool isDirChanged(fcheck_ctx *ctx, int inum)
+{
+	return ctx->olddir[inum] == NOBLOCK || ctx->olddirs[ctx->olddir[inum]].hash != ctx->dirhash[inum];
+}
+
+
+static void addNote(fcheck_ctx *ctx, int inum, uint target)
+{
+	if(ctx->nnotes == ctx->notescap)
+	{
+		ctx->notescap = ctx->notescap ? 2 * ctx->notescap : 1024;
+		ctx->notes = realloc(ctx->notes, ctx->notescap * sizeof(uint64_t));
+		if(ctx->notes == NULL)
+			outOfMemory(ctx);
+	}
+	ctx->notes[ctx->nnotes++] = (uint64_t)inum << 32 | target;
+}
+
+
+// Notes the non-empty entries of a checked directory block, for the
+// checkpoint.
+static void noteTargets(fcheck_ctx *ctx, int inum, Dirscan *ds, uint32_t bad)
+{
+	for(uint32_t m = ds->used & ~bad; m != 0; m &= m - 1)
+	{
+		uint e = __builtin_ctz(m);
+		bool counted = !(ds->dot >> e & 1) && !(ds->dotdot >> e & 1) &&
+				(ds->inum[e] != ROOTINO || inum > ROOTINO);
+		addNote(ctx, inum, ds->inum[e] | (counted ? COUNTED : 0));
+	}
+}
+
+
+// Takes the contributions of a directory to the refcounts back out.
+static void forgetDir(fcheck_ctx *ctx, Dirsummary *d)
+{
+	for(uint t = 0; t < d->ntargets; t++)
+	{
+		uint target = d->targets[t] & ~COUNTED;
+		if(d->targets[t] & COUNTED)
+			ctx->inodes.refcount[target]--;
+		ctx->mentions[target]--;
+	}
+	if(d->flags & DIR_REFERENCED)
+		ctx->inodes.refcount[ROOTINO]--;
+}
+
+
+// Reads the checkpoint at statepath. Any checkpoint that is missing,
+// unreadable or for an image of another shape is ignored, and everything
+// is checked; so is it at the full level. Returns true if the image is the
+// one the checkpoint was written for, which was clean, so there is nothing
+// left to check; the rest of the checkpoint isn't read then.
+static bool loadState(fcheck_ctx *ctx)
+{
+	FILE *f;
+	char magic[8];
+	uint hdr[6];
+	uint64_t digests[NDIGESTS];
+	size_t ntargets = 0;
+	long end;
+	uint *targets;
+
+	ctx->mentions = calloc(ctx->sb->ninodes, sizeof(uint));
+	ctx->dirhash = calloc(ctx->sb->ninodes, sizeof(uint64_t));
+	if(ctx->mentions == NULL || ctx->dirhash == NULL)
+		outOfMemory(ctx);
+	if(ctx->opts.level == FCHECK_FULL || (f = fopen(ctx->opts.statepath, "rb")) == NULL)
+		return false;
+
+	if(fread(magic, 1, sizeof(magic), f) != sizeof(magic) || memcmp(magic, STATEMAGIC, sizeof(magic)) != 0 ||
+			fread(hdr, sizeof(uint), 6, f) != 6 || hdr[0] != ctx->geo.bsize || hdr[1] != ctx->geo.ndirect ||
+			hdr[2] != ctx->sb->size || hdr[3] != ctx->sb->nblocks || hdr[4] != ctx->sb->ninodes || hdr[5] > ctx->sb->ninodes ||
+			fread(digests, sizeof(uint64_t), NDIGESTS, f) != NDIGESTS)
+		goto bad;
+
+	// a repair goes by what the passes found, so it has them run
+	if(!ctx->opts.repair && isUnchanged(ctx, digests))
+	{
+		fclose(f);
+		return true;
+	}
+
+	ctx->nolddirs = hdr[5];
+	ctx->oldrefcount = malloc((size_t)ctx->sb->ninodes * sizeof(uint));
+	ctx->olddirs = malloc((size_t)ctx->nolddirs * sizeof(Dirsummary) + 1);
+	ctx->olddir = malloc((size_t)ctx->sb->ninodes * sizeof(uint));
+	if(ctx->oldrefcount == NULL || ctx->olddirs == NULL || ctx->olddir == NULL ||
+			fread(ctx->oldrefcount, sizeof(uint), ctx->sb->ninodes, f) != ctx->sb->ninodes ||
+			fread(ctx->mentions, sizeof(uint), ctx->sb->ninodes, f) != ctx->sb->ninodes)
+		goto bad;
+
+	memset(ctx->olddir, 0xFF, (size_t)ctx->sb->ninodes * sizeof(uint));
+	for(uint d = 0; d < ctx->nolddirs; d++)
+	{
+		uint rec[5]; // hash (low, high), inum, flags, ntargets
+		if(fread(rec, sizeof(uint), 5, f) != 5 || rec[2] >= ctx->sb->ninodes || ctx->olddir[rec[2]] != NOBLOCK)
+			goto bad;
+		ctx->olddirs[d] = (Dirsummary){(uint64_t)rec[1] << 32 | rec[0], rec[2], rec[3], rec[4], NULL};
+		ctx->olddir[rec[2]] = d;
+		ntargets += rec[4];
+	}
+
+	end = ftell(f);
+	if(end < 0 || fseek(f, 0, SEEK_END) != 0 || ftell(f) - end != (long)(ntargets * sizeof(uint)) ||
+			fseek(f, end, SEEK_SET) != 0)
+		goto bad;
+	targets = ctx->oldtargets = malloc(ntargets * sizeof(uint) + 1);
+	if(targets == NULL || fread(targets, sizeof(uint), ntargets, f) != ntargets)
+		goto bad;
+	for(size_t t = 0; t < ntargets; t++)
+		if((targets[t] & ~COUNTED) >= ctx->sb->ninodes)
+			goto bad;
+	for(size_t d = 0, t = 0; d < ctx->nolddirs; t += ctx->olddirs[d].ntargets, d++)
+		ctx->olddirs[d].targets = targets + t;
+
+	ctx->incremental = true;
+	fclose(f);
+	return false;
+
+bad:
+	memset(ctx->mentions, 0, (size_t)ctx->sb->ninodes * sizeof(uint));
+	fclose(f);
+	return false;
+}
+
+
+// Writes the checkpoint for a clean image: the digests of what was read,
+// the refcounts and, for every directory, its digest, flags and entries, as
+// now or as the old checkpoint had them if unchanged. Written to a
+// temporary file and renamed over statepath, so a failed run leaves the old
+// checkpoint in place.
+static void saveState(fcheck_ctx *ctx)
+{
+	char tmppath[4096];
+	uint hdr[6] = {ctx->geo.bsize, ctx->geo.ndirect, ctx->sb->size, ctx->sb->nblocks, ctx->sb->ninodes, 0};
+	uint64_t digests[NDIGESTS] = {headDigest(ctx), 0, 0};
+	FILE *f;
+	bool failed;
+
+	snprintf(tmppath, sizeof(tmppath), "%s.tmp", ctx->opts.statepath);
+	if((f = fopen(tmppath, "wb")) == NULL)
+		systemError(ctx, "cannot write state");
+
+	if(ctx->nnotes > 0)
+		qsort(ctx->notes, ctx->nnotes, sizeof(uint64_t), cmpU64);
+	for(int inum = nextInode(ctx, 0); inum < ctx->sb->ninodes; inum = nextInode(ctx, inum + 1))
+		if(inode(ctx, inum)->type == T_DIR && isValidBlock(ctx, inode(ctx, inum)->addrs[0]))
+			hdr[5]++;
+	blocksDigest(ctx, digests, false);
+	for(int inum = 0; inum < ctx->sb->ninodes; inum++)
+		digests[2] += ctx->dirhash[inum];
+
+	fwrite(STATEMAGIC, 1, 8, f);
+	fwrite(hdr, sizeof(uint), 6, f);
+	fwrite(digests, sizeof(uint64_t), NDIGESTS, f);
+	fwrite(ctx->inodes.refcount, sizeof(uint), ctx->sb->ninodes, f);
+	fwrite(ctx->mentions, sizeof(uint), ctx->sb->ninodes, f);
+
+	// two passes over the directories: their records, then their entries
+	for(int pass = 0; pass < 2; pass++)
+	{
+		size_t note = 0;
+		for(int inum = nextInode(ctx, 0); inum < ctx->sb->ninodes; inum = nextInode(ctx, inum + 1))
+		{
+			if(inode(ctx, inum)->type != T_DIR || !isValidBlock(ctx, inode(ctx, inum)->addrs[0]))
+				continue;
+
+			size_t first = note;
+			while(note < ctx->nnotes && ctx->notes[note] >> 32 == (uint)inum)
+				note++;
+
+			Dirsummary d = {ctx->dirhash[inum], inum, ctx->inodes.dirflags[inum], note - first, NULL};
+			if(ctx->incremental && !isDirChanged(ctx, inum))
+				d = ctx->olddirs[ctx->olddir[inum]];
+
+			if(pass == 0)
+			{
+				uint rec[5] = {(uint)d.hash, d.hash >> 32, d.inum, d.flags, d.ntargets};
+				fwrite(rec, sizeof(uint), 5, f);
+			}
+			else if(d.targets != NULL)
+				fwrite(d.targets, sizeof(uint), d.ntargets, f);
+			else
+				for(size_t i = first; i < note; i++)
+				{
+					uint target = (uint)ctx->notes[i];
+					fwrite(&target, sizeof(uint), 1, f);
+				}
+		}
+	}
+
+	failed = ferror(f);
+	if(fclose(f) != 0 || failed || rename(tmppath, ctx->opts.statepath) != 0)
+	{
+		int err = errno;
+		unlink(tmppath);
+		errno = err;
+		systemError(ctx, "cannot write state");
+	}
+}
+
+
+// Entries of a directory block from entry s on that go through
+// checkDirBlock() at once, out of n.
+static uint sliceLen(uint n, uint s)
+{
+	return n - s < DSLICE ? n - s : DSLICE;
+}
+
+
+// Checks the k-th block of directory inum for the directory pass, noting
+// its entries for the checkpoint if there is one. Returns false if check 10
+// or 13 fails.
+//
+// Blocks come in disk order, so for check 13 the names of a directory are
+// only gathered over a run of its blocks; a directory met in more than one
+// run is marked DIR_SPLIT, and hasDuplicateNames() goes over it again.
+static bool checkDir(fcheck_ctx *ctx, int inum, struct dirent *de, uint k)
+{
+	uint n = dirEntries(ctx, inum, k);
+	bool ok = true;
+
+	if(ctx->names.inum != inum)
+	{
+		if(ctx->inodes.dirflags[inum] & DIR_NAMED)
+			ctx->inodes.dirflags[inum] |= DIR_SPLIT;
+		ctx->inodes.dirflags[inum] |= DIR_NAMED;
+		namesReset(&ctx->names, inum);
+	}
+
+	for(uint s = 0; s < n; s += DSLICE)
+	{
+		Dirscan ds;
+		uint32_t bad = checkDirBlock(ctx, inum, de + s, sliceLen(n, s), &ctx->inodes.dirflags[inum], &ds);
+
+		if(ctx->opts.statepath != NULL)
+		{
+			noteTargets(ctx, inum, &ds, bad);
+			for(uint32_t m = ds.used & ~bad; m != 0; m &= m - 1)
+				ctx->mentions[ds.inum[__builtin_ctz(m)]]++;
+		}
+		ok = ok && bad == 0 && addNames(ctx, &ctx->names, de + s, ds.used) == 0;
+	}
+	return ok;
+}
+
+
+// check 13 over all of directory inum at once
+static bool hasDuplicateNames(fcheck_ctx *ctx, int inum)
+{
+	Dircursor c;
+	struct dirent *de;
+	uint blocknum, k;
+
+	namesReset(&ctx->names, inum);
+	dirOpen(ctx, inum, &c);
+	while((de = dirNext(ctx, &c, &blocknum, &k)) != NULL)
+		for(uint s = 0, n = dirEntries(ctx, inum, k); s < n; s += DSLICE)
+		{
+			Dirscan ds;
+			scanDirBlock(inum, de + s, sliceLen(n, s), &ds);
+			if(addNames(ctx, &ctx->names, de + s, ds.used) != 0)
+				return true;
+		}
+	return false;
+}
+
+
+// The directory pass of a scan that isn't exact: checks 3, 4, 10 and 13 and the
+// book keeping for check 9, over the directory blocks the workers noted,
+// read in disk order rather than inode order so that a cold image is read
+// sequentially. Directories from firstbad on may not have been scanned and
+// are left out. Returns false if any violation was found; the exact scan
+// then tells which ones, in order.
+//
+// With a checkpoint, and nothing found so far, directories are only
+// digested, and only those that changed since are checked; the refcounts
+// start from the checkpoint's, less what the changed directories had.
+static bool checkDirectories(fcheck_ctx *ctx, Worker *workers, int nworkers)
+{
+	size_t n = 0;
+	bool ok = true;
+	bool reuse;
+
+	ctx->incremental = ctx->incremental && ctx->firsterr == NULL && ctx->nviolations == 0;
+	reuse = ctx->incremental;
+
+	for(int t = 0; t < nworkers; t++)
+		n += workers[t].ndirblocks;
+
+	if(n > ctx->dirblockscap)
+	{
+		free(ctx->dirblocks);
+		free(ctx->sortbuf);
+		ctx->dirblocks = malloc(n * sizeof(Dirblock));
+		ctx->sortbuf = malloc(n * sizeof(Dirblock));
+		ctx->dirblockscap = n;
+		if(ctx->dirblocks == NULL || ctx->sortbuf == NULL)
+			outOfMemory(ctx);
+	}
+	Dirblock *dirblocks = ctx->dirblocks;
+	for(int t = 0, i = 0; t < nworkers; i += workers[t].ndirblocks, t++)
+		if(workers[t].ndirblocks > 0)
+			memcpy(dirblocks + i, workers[t].dirblocks, workers[t].ndirblocks * sizeof(Dirblock));
+	sortDirblocks(dirblocks, ctx->sortbuf, n);
+
+	startPhase(ctx, "directories");
+	phaseBytes(ctx, n * ctx->geo.bsize);
+	ctx->names.inum = -1;
+	if(n > 0)
+		ctx->image.advise(ctx, dirblocks[0].blocknum, dirblocks[n - 1].blocknum, MADV_SEQUENTIAL);
+
+	for(size_t i = 0, ahead = 0; i < n; i++)
+	{
+		// ask for the next WINDOW blocks ahead of time, a run of adjacent
+		// blocks at a time
+		while(ahead < n && ahead < i + WINDOW)
+		{
+			size_t run = ahead;
+			while(run + 1 < n && run + 1 < i + WINDOW &&
+					dirblocks[run + 1].blocknum <= dirblocks[run].blocknum + 1)
+				run++;
+			ctx->image.advise(ctx, dirblocks[ahead].blocknum, dirblocks[run].blocknum, MADV_WILLNEED);
+			ahead = run + 1;
+		}
+
+		int inum = dirblocks[i].inum;
+		if(inum >= ctx->firstbad)
+			continue;
+		struct dirent *de = (struct dirent *) getBlock(ctx, dirblocks[i].blocknum);
+
+		if(ctx->opts.statepath != NULL)
+			ctx->dirhash[inum] += blockDigest(ctx, inum, dirblocks[i].blocknum, dirblocks[i].k, de);
+		if(!reuse && !checkDir(ctx, inum, de, dirblocks[i].k))
+			ok = false;
+	}
+
+	if(reuse)
+	{
+		memcpy(ctx->inodes.refcount, ctx->oldrefcount, (size_t)ctx->sb->ninodes * sizeof(uint));
+		for(uint d = 0; d < ctx->nolddirs; d++)
+		{
+			int inum = ctx->olddirs[d].inum;
+			if(inode(ctx, inum)->type != T_DIR || !isValidBlock(ctx, inode(ctx, inum)->addrs[0]) || isDirChanged(ctx, inum))
+				forgetDir(ctx, &ctx->olddirs[d]);
+		}
+
+		ctx->names.inum = -1;
+		for(size_t i = 0; i < n; i++)
+		{
+			int inum = dirblocks[i].inum;
+			if(isDirChanged(ctx, inum) &&
+					!checkDir(ctx, inum, (struct dirent *) getBlock(ctx, dirblocks[i].blocknum), dirblocks[i].k))
+				ok = false;
+		}
+
+		// check 10 for the directories that did not change: none may name
+		// an inode that is now free
+		for(int inum = 0; inum < ctx->sb->ninodes; inum++)
+			if(inode(ctx, inum)->type == 0 && ctx->mentions[inum] > 0)
+				ok = false;
+	}
+
+	for(int inum = 0; inum < ctx->firstbad; inum++)
+	{
+		if(inode(ctx, inum)->type != T_DIR || (reuse && !isDirChanged(ctx, inum)))
+			continue;
+		if(isValidBlock(ctx, inode(ctx, inum)->addrs[0]) && !isDirFormatted(ctx, inum, ctx->inodes.dirflags[inum]))
+			ok = false;
+		if(inum == ROOTINO && !(ctx->inodes.dirflags[inum] & DIR_PARENTSELF))
+			ok = false;
+		if((ctx->inodes.dirflags[inum] & DIR_SPLIT) && hasDuplicateNames(ctx, inum))
+			ok = false;
+	}
+	return ok;
+}
+
+
+// What the per-inode checks do with one address of an inode, as
+// walkBlocks() visits it. Returns true to stop the walk, and the inode's
+// checks with it.
+typedef bool (*Blockvisitor)(fcheck_ctx *ctx, int inum, Worker *w, uint blocknum, int kind);
+
+#define ADDR_DIRECT   0 // an address in the inode
+#define ADDR_INDIRECT 1 // the inode's indirect block
+#define ADDR_ENTRY    2 // an address in the indirect block
+
+// What a directory walk does with one block of directory inum, its k-th, as
+// walkDir() visits it. Returns true to stop the walk.
+typedef bool (*Dirvisitor)(fcheck_ctx *ctx, int inum, Worker *w, uint k, uint blocknum, struct dirent *de, void *arg);
+
+
+// Visits every address of an inode in the order the checks take them: the
+// direct ones, the indirect block, then the non-empty entries of that,
+// skipping runs of 8 empty ones at once. Always inlined with a constant
+// visitor, so each walk is a plain loop with the visitor's code in it.
+static inline __attribute__((always_inline)) bool walkBlocks(fcheck_ctx *ctx, int inum, Worker *w, Blockmap *bm,
+		uint ndirect, uint nindirect, Blockvisitor visit)
+{
+	for(uint b = 0; b < ndirect; b++)
+		if(visit(ctx, inum, w, bm->addrs[b], ADDR_DIRECT))
+			return true;
+	if(visit(ctx, inum, w, bm->addrs[ndirect], ADDR_INDIRECT))
+		return true;
+	for(uint i = 0; bm->indirect != NULL && i < nindirect; i += 8)
+	{
+		if(isZero(bm->indirect + i, 8 * sizeof(uint)))
+			continue;
+		for(uint j = i; j < i + 8; j++)
+			if(bm->indirect[j] != 0 && visit(ctx, inum, w, bm->indirect[j], ADDR_ENTRY))
+				return true;
+	}
+	return false;
+}
+
+
+// check 2
+static inline __attribute__((always_inline)) bool checkAddress(fcheck_ctx *ctx, int inum, Worker *w, uint blocknum, int kind)
+{
+	if(blocknum < ctx->sb->size)
+		return false;
+	return inodeViolation(ctx, 2, inum, blocknum,
+			kind == ADDR_DIRECT ? "bad direct address in inode." : "bad indirect address in inode.");
+}
+
+
+// checks 5, 7 and 8, skipping the addresses check 2 rejected
+static inline __attribute__((always_inline)) bool checkUse(fcheck_ctx *ctx, int inum, Worker *w, uint blocknum, int kind)
+{
+	if(blocknum == 0 || !isValidBlock(ctx, blocknum))
+		return false;
+
+	if(kind == ADDR_DIRECT)
+	{
+		bool reused = isReused(ctx, w, blocknum);
+		if(isMarkedFree(ctx, blocknum, w->exact) &&
+				inodeViolation(ctx, 5, inum, blocknum, "address used by inode but marked free in bitmap."))
+			return true;
+		return reused && inodeViolation(ctx, 7, inum, blocknum, "direct address used more than once.");
+	}
+
+	if(isMarkedFree(ctx, blocknum, w->exact) &&
+			inodeViolation(ctx, 5, inum, blocknum, "address used by inode but marked free in bitmap."))
+		return true;
+	return isReused(ctx, w, blocknum) &&
+			inodeViolation(ctx, 8, inum, blocknum, "indirect address used more than once.");
+}
+
+
+// Visits the blocks of directory inum in order. Returns true if the visitor
+// stopped the walk.
+static inline __attribute__((always_inline)) bool walkDir(fcheck_ctx *ctx, int inum, Worker *w, Dirvisitor visit, void *arg)
+{
+	Dircursor c;
+	struct dirent *de;
+	uint blocknum, k;
+
+	dirOpen(ctx, inum, &c);
+	while((de = dirNext(ctx, &c, &blocknum, &k)) != NULL)
+		if(visit(ctx, inum, w, k, blocknum, de, arg))
+			return true;
+	return false;
+}
+
+
+// check 3, in the exact scan: stops at the block where the root's .. entry
+// points to itself.
+static inline __attribute__((always_inline)) bool findParentSelf(fcheck_ctx *ctx, int inum, Worker *w, uint k, uint blocknum, struct dirent *de, void *arg)
+{
+	Dirscan ds;
+
+	for(uint s = 0, n = dirEntries(ctx, inum, k); s < n; s += DSLICE)
+	{
+		scanDirBlock(inum, de + s, sliceLen(n, s), &ds);
+		if(ds.dotdot & ds.self)
+			return true;
+	}
+	return false;
+}
+
+
+// Notes a block for the directory pass.
+static inline __attribute__((always_inline)) bool noteDirBlock(fcheck_ctx *ctx, int inum, Worker *w, uint k, uint blocknum, struct dirent *de, void *arg)
+{
+	addDirblock(ctx, w, blocknum, inum, k);
+	return false;
+}
+
+
+// Checks 4, 10 and 13 in the exact scan, with the flags of the directory in
+// arg: one violation per failing entry.
+static inline __attribute__((always_inline)) bool checkDirEntries(fcheck_ctx *ctx, int inum, Worker *w, uint k, uint blocknum, struct dirent *de, void *arg)
+{
+	w->blocksread++;
+	for(uint s = 0, n = dirEntries(ctx, inum, k); s < n; s += DSLICE)
+	{
+		Dirscan ds;
+		for(uint32_t bad = checkDirBlock(ctx, inum, de + s, sliceLen(n, s), arg, &ds); bad != 0; bad &= bad - 1)
+			if(inodeViolation(ctx, 10, inum, blocknum, "inode referred to in directory but marked free."))
+				return true;
+		for(uint32_t dup = addNames(ctx, &ctx->names, de + s, ds.used); dup != 0; dup &= dup - 1)
+			if(inodeViolation(ctx, 13, inum, blocknum, "directory has two entries with the same name."))
+				return true;
+	}
+	return false;
+}
+
+
+// The bits of SCREEN bytes that are each 0 or 1, byte i to bit i: a
+// multiply gathers 8 of them at once.
+static inline uint64_t packBits(uchar *bytes)
+{
+	uint64_t bits = 0, b8;
+
+	for(uint i = 0; i < SCREEN; i += 8)
+	{
+		memcpy(&b8, bytes + i, 8);
+		bits |= ((b8 * 0x0102040810204080ull) >> 56) << i;
+	}
+	return bits;
+}
+
+
+// Screens n inodes from start for the per-inode checks: decodes their
+// types into a column and compares the whole column at once for check 1,
+// with no branches so the compiler does it 16 at a time, then compares the
+// addresses of those in use for check 2. Returns a bit for each inode the
+// checks have anything to do with: in use, of a bad type, or the root.
+// Those that fail are in bad, to be checked again one address at a time.
+static inline __attribute__((always_inline)) uint64_t screenInodes(fcheck_ctx *ctx, int start, uint n, uint ndirect, uint64_t *bad)
+{
+	const size_t inodesize = sizeof(Dinode) + (ndirect + 1) * sizeof(uint);
+	char *first = ctx->itable + (size_t)start * inodesize;
+	ushort types[SCREEN];
+	uchar badtype[SCREEN], inuse[SCREEN];
+	uint64_t root = start <= ROOTINO && ROOTINO < start + (int)n ? (uint64_t) 1 << (ROOTINO - start) : 0;
+
+	*bad = 0;
+	for(uint i = 0; i < SCREEN; i++)
+		types[i] = i < n ? ((Dinode *) (first + i * inodesize))->type : 0;
+	for(uint i = 0; i < SCREEN; i++) // check 1: types are 0 to T_DEV
+	{
+		badtype[i] = types[i] > T_DEV;
+		inuse[i] = types[i] != 0;
+	}
+	*bad = packBits(badtype);
+	uint64_t used = packBits(inuse);
+
+	for(uint64_t left = used & ~*bad; left != 0; left &= left - 1) // check 2
+	{
+		uint i = __builtin_ctzll(left), wrong = 0;
+		uint *addrs = ((Dinode *) (first + i * inodesize))->addrs;
+
+		for(uint a = 0; a <= ndirect; a++)
+			wrong |= addrs[a] >= ctx->sb->size;
+		*bad |= (uint64_t) wrong << i;
+	}
+
+	return used | root;
+}
+
+
+// Whether every entry of an indirect block is in the image (check 2), with
+// no branches, as screenInodes().
+static inline __attribute__((always_inline)) bool areValidEntries(fcheck_ctx *ctx, uint *indirect, uint nindirect)
+{
+	uint size = ctx->sb->size;
+	uint bad = 0;
+
+	for(uint i = 0; i < nindirect; i++)
+		bad |= indirect[i] >= size;
+	return bad == 0;
+}
+
+
+// Runs checks 1, 2, 3, 4, 5, 7, 8, 10 and 13 on one inode, and does the directory
+// book keeping for checks 9, 11 and 12. Violations are reported in the order
+// the serial scan meets them; returns true if one of them ends the scan.
+// If screened, screenInodes() found its type and its own addresses valid.
+//
+// Always inlined into the scanChunk kernels below, so that with the block
+// size and number of direct addresses constant the address loops have fixed
+// trip counts and inodes are a fixed size apart.
+static inline __attribute__((always_inline)) bool checkInodeAs(fcheck_ctx *ctx, int inum, Worker *w, uint bsize, uint ndirect, bool screened)
+{
+	const uint nindirect = bsize / sizeof(uint);
+	Dinode *dip = (Dinode *) (ctx->itable + (size_t)inum * (sizeof(Dinode) + (ndirect + 1) * sizeof(uint)));
+
+	// check 1: Each inode is either unallocated or one of the valid types
+	if(!screened && dip->type != 0 && dip->type != T_DIR && dip->type != T_FILE && dip->type != T_DEV)
+		return inodeViolation(ctx, 1, inum, NOBLOCK, "bad inode."); // the rest of it is garbage
+
+	// check 2:  For in-use inodes, each block address that is used by 
+	// the inode is valid (points to a valid data block address within the image)
+	//
+	// Screened, only the entries of the indirect block are left, and they
+	// are walked one at a time only if one of them fails.
+	Blockmap bm = {0};
+	if(dip->type != 0)
+	{
+		blockMap(ctx, dip, ndirect, &bm);
+		if(bm.indirect != NULL)
+			w->blocksread++;
+		if((!screened || (bm.indirect != NULL && !areValidEntries(ctx, bm.indirect, nindirect))) &&
+				walkBlocks(ctx, inum, w, &bm, ndirect, nindirect, checkAddress))
+			return true;
+	}
+
+	//check 3: Root directory exists, its inode number is 1, and the parent 
+	//of the root directory is itself
+	if(inum == ROOTINO)
+	{
+		if(dip->type != T_DIR &&
+				inodeViolation(ctx, 3, inum, NOBLOCK, "root directory does not exist."))
+			return true;
+
+		bool parentisitself = !w->exact; // else left to the directory pass
+		if(w->exact && dip->type == T_DIR && isValidBlock(ctx, dip->addrs[0]))
+			parentisitself = walkDir(ctx, inum, w, findParentSelf, NULL);
+
+		if(!parentisitself &&
+				inodeViolation(ctx, 3, inum, dip->addrs[0], "root directory does not exist."))
+			return true;
+
+	}
+
+	// check 4: Each directory contains . and .. entries, and the . entry points 
+	// to the directory itself
+	//
+	// Unless the scan is exact, this only notes which blocks the directory has
+	// so that the directory pass can read them in disk order.
+	if(dip->type == T_DIR && isValidBlock(ctx, dip->addrs[0]) && !w->exact)
+		walkDir(ctx, inum, w, noteDirBlock, NULL);
+	else if(dip->type == T_DIR && isValidBlock(ctx, dip->addrs[0]))
+	{
+		uchar flags = 0;
+
+		namesReset(&ctx->names, inum);
+		if(walkDir(ctx, inum, w, checkDirEntries, &flags))
+			return true;
+
+		if(!isDirFormatted(ctx, inum, flags) &&
+				inodeViolation(ctx, 4, inum, dip->addrs[0], "directory not properly formatted."))
+			return true;
+
+	}
+
+	// check 5: For in-use inodes, each block address in use is also marked in use in the bitmap.
+	// for the next check need to mark the blocks used in the block entry
+	
+	// check 7: For in-use inodes, each direct address in use is only used once.
+	// check 8: For in-use inodes, each indirect address in use is only used once.
+	//
+	// Addresses check 2 rejected are skipped.
+
+	if(dip->type != 0 && walkBlocks(ctx, inum, w, &bm, ndirect, nindirect, checkUse))
+		return true;
+
+	return false;
+}
+
+
+// Notes that inodes lo to hi of a screen are in use, as screenInodes()
+// found, for nextInode().
+static void occupy(fcheck_ctx *ctx, int lo, int hi)
+{
+	for(uint s = lo / SCREEN; s <= (uint)hi / SCREEN; s++)
+		if(!testBit(ctx->inodes.occupied, s))
+			__atomic_fetch_or(&ctx->inodes.occupied[s / 64], (uint64_t) 1 << (s % 64), __ATOMIC_RELAXED);
+}
+
+
+// Checks inodes start to end, or up to the lowest inode already known to
+// fail, screening SCREEN of them at a time; free inodes other than the root
+// have nothing to check. One kernel per common geometry, and scanChunkAny
+// for the others; setGeometry() picks the kernel for the image.
+#define SCANCHUNK(name, bsize, ndirect) \
+static void name(fcheck_ctx *ctx, Worker *w, int start, int end) \
+{ \
+	for(int first = start; first < end; first += SCREEN) \
+	{ \
+		uint64_t bad, todo = screenInodes(ctx, first, end - first < SCREEN ? end - first : SCREEN, ndirect, &bad); \
+		if(todo != 0 && !w->exact) \
+			occupy(ctx, first + __builtin_ctzll(todo), first + 63 - __builtin_clzll(todo)); \
+		for(; todo != 0; todo &= todo - 1) \
+		{ \
+			int i = __builtin_ctzll(todo); \
+			if(first + i >= __atomic_load_n(&ctx->firstbad, __ATOMIC_RELAXED) || \
+					checkInodeAs(ctx, first + i, w, bsize, ndirect, !((bad >> i) & 1))) \
+				return; \
+		} \
+	} \
+}
+
+SCANCHUNK(scanChunk_512_12, 512, 12)
+SCANCHUNK(scanChunk_1024_12, 1024, 12)
+SCANCHUNK(scanChunk_2048_12, 2048, 12)
+SCANCHUNK(scanChunk_4096_12, 4096, 12)
+SCANCHUNK(scanChunkAny, ctx->geo.bsize, ctx->geo.ndirect)
+
+
+// Claims chunks of the inode table in order and checks them until done or
+// until past the lowest inode already known to fail. Every chunk is checked
+// in inode order, so the lowest failing inode over all workers carries the
+// violation the serial scan would have stopped at.
+static void *inodeWorker(void *arg)
+{
+	Worker *w = arg;
+	fcheck_ctx *ctx = w->ctx;
+	int start;
+
+	while((start = __atomic_fetch_add(&ctx->nextinode, CHUNK, __ATOMIC_RELAXED)) < ctx->sb->ninodes)
+	{
+		int end = start + CHUNK < ctx->sb->ninodes ? start + CHUNK : ctx->sb->ninodes;
+
+		ctx->scanchunk(ctx, w, start, end);
+	}
+	if(ctx->sorted && !w->exact)
+		finishUses(ctx, w);
+	return NULL;
+}
+
+
+// Whether any block used by an inode is marked free in the bitmap (check 5),
+// comparing whole words of the referenced and bitset planes. The loop has no
+// branches so the compiler can do it 256 bits at a time.
+static bool hasMarkedFreeBlocks(fcheck_ctx *ctx)
+{
+	size_t nwords = ((size_t)ctx->sb->size + 63) / 64;
+	uint64_t diff = 0;
+
+	for(size_t w = 0; w < nwords; w++)
+		diff |= ctx->dblocks.referenced[w] & ~ctx->dblocks.bitset[w];
+	return diff != 0;
+}
+
+
+// At least nthreads workers, keeping those of earlier scans and their
+// buffers.
+static Worker *workersFor(fcheck_ctx *ctx, int nthreads)
+{
+	if(nthreads > ctx->nworkers)
+	{
+		Worker *workers = realloc(ctx->workers, nthreads * sizeof(Worker));
+		if(workers == NULL)
+			outOfMemory(ctx);
+		memset(workers + ctx->nworkers, 0, (nthreads - ctx->nworkers) * sizeof(Worker));
+		ctx->workers = workers;
+		ctx->nworkers = nthreads;
+	}
+	return ctx->workers;
+}
+
+
+// Runs the per-inode checks over the whole inode table on nthreads threads.
+// Unless the scan is exact, checks 5, 7 and 8 are only done in bulk and
+// directories are read by a separate pass; if either finds anything the scan
+// is redone serially and exactly, so the violations are blamed on the inodes
+// the serial scan would blame. So it is if the threads found more violations
+// than the report keeps. If threads can't be started, this thread does
+// the work of the ones missing.
+static void checkInodes(fcheck_ctx *ctx, int nthreads, bool exact)
+{
+	bool dirsok;
+	int started = 0;
+	uint before = ctx->nviolations; // found ahead of the scan
+
+	Worker *workers = workersFor(ctx, nthreads);
+	for(int t = 0; t < nthreads; t++)
+	{
+		workers[t].ctx = ctx;
+		workers[t].exact = exact;
+		workers[t].ndirblocks = 0;
+		workers[t].blocksread = 0;
+		workers[t].nuses = 0;
+		if(ctx->sorted && !exact && (workers[t].usescap < ctx->spillcap || (ctx->external && workers[t].usescap > ctx->spillcap)))
+		{
+			free(workers[t].uses);
+			workers[t].usescap = 0;
+			if((workers[t].uses = malloc(2 * ctx->spillcap * sizeof(uint))) == NULL)
+				outOfMemory(ctx);
+			workers[t].usescap = ctx->spillcap;
+		}
+	}
+	if(!exact)
+	{
+		closeRuns(ctx);
+		memset(ctx->inodes.occupied, 0, ((size_t)ctx->sb->ninodes / SCREEN + 64) / 64 * sizeof(uint64_t));
+		ctx->screened = false;
+	}
+	ctx->spillfailed = false;
+
+	ctx->nextinode = 0;
+	ctx->firstbad = ctx->sb->ninodes;
+	ctx->firsterr = NULL;
+	ctx->collided = false;
+	ctx->outofmemory = false;
+
+	startPhase(ctx, exact ? "rescan" : "inodes");
+	if(nthreads > 1)
+		while(started < nthreads && pthread_create(&workers[started].thread, NULL, inodeWorker, &workers[started]) == 0)
+			started++;
+	if(started < nthreads)
+		inodeWorker(&workers[started]);
+	for(int t = 0; t < started; t++)
+		pthread_join(workers[t].thread, NULL);
+	for(int t = 0; ctx->sorted && !ctx->external && !exact && t < nthreads; t++)
+		addRun(ctx, (Run){NULL, workers[t].uses, workers[t].nuses});
+	if(ctx->outofmemory)
+		outOfMemory(ctx);
+	if(ctx->spillfailed)
+		systemError(ctx, "can't write a run file");
+	if(!exact)
+		ctx->screened = ctx->firstbad == ctx->sb->ninodes;
+
+	phaseBytes(ctx, (uint64_t)ctx->sb->ninodes * ctx->geo.inodesize);
+	for(int t = 0; t < nthreads; t++)
+		phaseBytes(ctx, workers[t].blocksread * ctx->geo.bsize);
+
+	dirsok = exact || checkDirectories(ctx, workers, nthreads);
+
+	bool usesok = true;
+	if(!exact && ctx->sorted)
+	{
+		startPhase(ctx, "merge");
+		usesok = isUseConsistent(ctx);
+	}
+	else if(!exact)
+		usesok = !ctx->collided && !hasMarkedFreeBlocks(ctx);
+
+	// past RINGSIZE violations, which of the threads' stay listed would
+	// depend on their timing: the serial scan keeps those it would
+	bool overflowed = nthreads > 1 && ctx->nviolations > RINGSIZE;
+
+	if(!exact && (!usesok || !dirsok || overflowed))
+	{
+		arenaReset(ctx);
+		ringRewind(ctx, before);
+		checkInodes(ctx, 1, true);
+		return;
+	}
+
+	if(ctx->firsterr != NULL)
+		throwerr(ctx, ctx->firsterr);
+}
+
+
+static void setGeometry(fcheck_ctx *ctx, uint bsize, uint ndirect)
+{
+	Geometry *g = &ctx->geo;
+
+	g->bsize = bsize;
+	g->ndirect = ndirect;
+	g->nindirect = bsize / sizeof(uint);
+	g->maxfile = ndirect + g->nindirect;
+	g->inodesize = sizeof(Dinode) + (ndirect + 1) * sizeof(uint);
+	g->ipb = bsize / g->inodesize;
+	g->bpb = bsize * 8;
+	g->dpb = bsize / sizeof(struct dirent);
+
+	ctx->scanchunk = scanChunkAny;
+	if(ndirect == 12)
+	{
+		if(bsize == 512)
+			ctx->scanchunk = scanChunk_512_12;
+		else if(bsize == 1024)
+			ctx->scanchunk = scanChunk_1024_12;
+		else if(bsize == 2048)
+			ctx->scanchunk = scanChunk_2048_12;
+		else if(bsize == 4096)
+			ctx->scanchunk = scanChunk_4096_12;
+	}
+}
+
+
+static bool isGeometry(uint bsize, uint ndirect)
+{
+	return bsize >= MINBSIZE && bsize <= MAXBSIZE && (bsize & (bsize - 1)) == 0 &&
+			ndirect >= 1 && ndirect <= MAXNDIRECT;
+}
+
+
+// Whether the superblock in the head of the image adds up for geometry g the
+// way mkfs lays an image out.
+static bool isMkfsLayout(fcheck_ctx *ctx, uint bsize, uint ndirect)
+{
+	char *head = ctx->image.head(ctx, 2 * bsize);
+	if(head == NULL)
+		return false;
+	struct superblock *sb = (struct superblock *) (head + bsize);
+
+	setGeometry(ctx, bsize, ndirect);
+	return sb->ninodes > 0 && sb->size > sb->ninodes / ctx->geo.ipb + 3 + sb->size / ctx->geo.bpb + 1 &&
+			sb->nblocks == sb->size - (sb->ninodes / ctx->geo.ipb + 3 + sb->size / ctx->geo.bpb + 1);
+}
+
+
+// The number of direct addresses the superblock for block size bsize says
+// the image has after its three fields, with GEOMAGIC ahead, or 0 if it
+// says none.
+static uint taggedNdirect(fcheck_ctx *ctx, uint bsize)
+{
+	char *head = ctx->image.head(ctx, 2 * bsize);
+	if(head == NULL)
+		return 0;
+	uint *sb = (uint *) (head + bsize);
+
+	return sb[3] == GEOMAGIC && sb[4] == bsize && isGeometry(sb[4], sb[5]) ? sb[5] : 0;
+}
+
+
+// Settles the block size and number of direct addresses of the image: from
+// opts if given, else from the superblock if it has them after its three
+// fields, with GEOMAGIC ahead, else the one of xv6 if the superblock adds up
+// for it, else the first larger block size it adds up for. Anything else is
+// taken to be an xv6 image.
+//
+// A geometry given must be the one the superblock says, or one it adds up
+// for; else it is check 0 that fails.
+static void readGeometry(fcheck_ctx *ctx)
+{
+	uint bsize = ctx->opts.bsize, ndirect = ctx->opts.ndirect ? ctx->opts.ndirect : NDIRECT;
+
+	if(isGeometry(bsize, ndirect))
+	{
+		bool fits = taggedNdirect(ctx, bsize) == ndirect || isMkfsLayout(ctx, bsize, ndirect);
+		setGeometry(ctx, bsize, ndirect);
+		if(!fits)
+			violation(ctx, 0, -1, NOBLOCK, "superblock does not fit the geometry given.");
+		return;
+	}
+
+	for(bsize = MINBSIZE; bsize <= MAXBSIZE; bsize *= 2)
+		if((ndirect = taggedNdirect(ctx, bsize)) != 0)
+		{
+			setGeometry(ctx, bsize, ndirect);
+			return;
+		}
+
+	for(bsize = MINBSIZE; bsize <= MAXBSIZE; bsize *= 2)
+		if(isMkfsLayout(ctx, bsize, NDIRECT))
+			return;
+	setGeometry(ctx, BSIZE, NDIRECT);
+}
+
+
+// check 0: The superblock matches the image: its counts add up the way
+// mkfs lays an image out, and the image is as long as it says. The length
+// of a pipe isn't known.
+static void checkSuperblock(fcheck_ctx *ctx)
+{
+	struct superblock *sb = ctx->sb;
+	uint64_t metablocks = sb->ninodes / ctx->geo.ipb + 3 + sb->size / ctx->geo.bpb + 1;
+
+	if(sb->ninodes == 0 || metablocks >= sb->size || sb->nblocks != sb->size - metablocks)
+		violation(ctx, 0, -1, NOBLOCK, "superblock counts do not add up.");
+	else if(ctx->imagesize > 0 && (uint64_t)sb->size * ctx->geo.bsize > (uint64_t)ctx->imagesize)
+		violation(ctx, 0, -1, NOBLOCK, "image shorter than its superblock says.");
+}
+
+
+// Reads the superblock, then the inodes and the bitmap, which follow it.
+static void readHead(fcheck_ctx *ctx)
+{
+	readGeometry(ctx);
+
+	char *head = ctx->image.head(ctx, 2 * ctx->geo.bsize);
+	if(head == NULL)
+		imageTooSmall(ctx);
+	ctx->sb = (struct superblock *) (head + 1 * ctx->geo.bsize);
+	if(ctx->opts.level != FCHECK_NORMAL || ctx->opts.repair) // a repair goes by it
+		checkSuperblock(ctx);
+
+	size_t bitmapstart = (size_t)bitmapStart(ctx) * ctx->geo.bsize;
+	size_t bitmaplen = ((size_t)ctx->sb->size + 7) / 8;
+	head = ctx->image.head(ctx, bitmapstart + (bitmaplen + ctx->geo.bsize - 1) / ctx->geo.bsize * ctx->geo.bsize);
+	if(head == NULL)
+		imageTooSmall(ctx);
+	ctx->sb = (struct superblock *) (head + 1 * ctx->geo.bsize);
+	ctx->itable = head + 2 * ctx->geo.bsize;
+
+	arenaInit(ctx, head + bitmapstart);
+	phaseBytes(ctx, bitmapstart + bitmaplen);
+}
+
+
+// check 6 when blocks are sorted: goes through the bitmap and the merged
+// runs together.
+static void checkBitmapRuns(fcheck_ctx *ctx)
+{
+	uint start = dataStart(ctx), next;
+	size_t nwords = ((size_t)ctx->sb->size + 63) / 64;
+
+	mergeOpen(ctx, ctx->runs, ctx->nruns);
+	next = mergeNext(ctx);
+	phaseBytes(ctx, (nwords - start / 64) * sizeof(uint64_t));
+	for(size_t w = start / 64; w < nwords; w++)
+		for(uint64_t marked = ctx->dblocks.bitset[w]; marked != 0; marked &= marked - 1)
+		{
+			uint bnum = w * 64 + __builtin_ctzll(marked);
+			if(bnum < start || bnum >= ctx->sb->size)
+				continue;
+			while(next < bnum)
+				next = mergeNext(ctx);
+			if(next != bnum)
+				violation(ctx, 6, -1, bnum, "bitmap marks block in use but it is not in use.");
+		}
+	mergeClose(ctx);
+}
+
+
+// check 6: For blocks marked in-use in bitmap, the block should actually be in-use in an
+// inode or indirect block somewhere
+static void checkBitmap(fcheck_ctx *ctx)
+{
+	int datablockstart = dataStart(ctx);
+
+	if(ctx->sorted)
+	{
+		checkBitmapRuns(ctx);
+		return;
+	}
+
+	// compare the bitmap with the blocks in use 256 at a time, and only
+	// look for block numbers where they differ
+	size_t nwords = ((size_t)ctx->sb->size + 63) / 64;
+	phaseBytes(ctx, 2 * (nwords - datablockstart / 64) * sizeof(uint64_t));
+	for(size_t w = datablockstart / 64; w < nwords; w += 4)
+	{
+		uint64_t unused[4], diff = 0;
+
+		for(int k = 0; k < 4; k++)
+		{
+			unused[k] = w + k < nwords ? ctx->dblocks.bitset[w + k] & ~ctx->dblocks.referenced[w + k] : 0;
+			diff |= unused[k];
+		}
+		if(diff == 0)
+			continue;
+
+		for(int k = 0; k < 4; k++)
+			for(; unused[k] != 0; unused[k] &= unused[k] - 1)
+			{
+				uint bnum = (w + k) * 64 + __builtin_ctzll(unused[k]);
+				if(bnum < datablockstart)
+					continue;
+				violation(ctx, 6, -1, bnum, "bitmap marks block in use but it is not in use.");
+			}
+	}
+}
+
+
+// check 9: For all inodes marked in use, each must be referred to in at least one directory
+// check 11: Reference counts (number of links) for regular files match the number of times
+// file is referred to in directories (i.e., hard links work correctly).
+//
+// check 12: No extra links allowed for directories (each directory only appears in one other
+// directory).
+static void checkLinks(fcheck_ctx *ctx)
+{
+	phaseBytes(ctx, occupiedInodes(ctx) * (ctx->geo.inodesize + sizeof(uint)));
+
+	for(int inum = nextInode(ctx, 1); inum < ctx->sb->ninodes; inum = nextInode(ctx, inum + 1))
+	{
+		if(inode(ctx, inum)->type != 0 && ctx->inodes.refcount[inum] < 1)
+		{
+			violation(ctx, 9, inum, NOBLOCK, "inode marked use but not found in a directory.");
+		}
+
+		if(inode(ctx, inum)->type == T_FILE && inode(ctx, inum)->nlink != ctx->inodes.refcount[inum])
+		{
+			violation(ctx, 11, inum, NOBLOCK, "bad reference count for file.");
+		}
+
+		if(inode(ctx, inum)->type == T_DIR && ctx->inodes.refcount[inum] > 1)
+		{
+			violation(ctx, 12, inum, NOBLOCK, " directory appears more than once in file system.");
+		}
+
+	}
+}
+
+
+// Marks inode inum reached by the tree walk. Returns false if it already
+// was; the bit is an atomic test-and-set so walkers can race on it.
+static bool reach(fcheck_ctx *ctx, uint inum)
+{
+	uint64_t m = (uint64_t)1 << (inum % 64);
+
+	return (__atomic_fetch_or(&ctx->inodes.reached[inum / 64], m, __ATOMIC_RELAXED) & m) == 0;
+}
+
+
+// Puts directory inum on the tail of w's deque, to be visited.
+static void walkPush(fcheck_ctx *ctx, Worker *w, uint inum)
+{
+	__atomic_fetch_add(&ctx->walkpending, 1, __ATOMIC_ACQ_REL);
+	pthread_mutex_lock(&w->walklock);
+	if(w->walktail == w->walkcap && w->walkhead > 0) // what is left, down to the start
+	{
+		memmove(w->walkdirs, w->walkdirs + w->walkhead, (w->walktail - w->walkhead) * sizeof(uint));
+		w->walktail -= w->walkhead;
+		w->walkhead = 0;
+	}
+	if(w->walktail == w->walkcap)
+	{
+		uint cap = w->walkcap ? 2 * w->walkcap : 256;
+		uint *dirs = realloc(w->walkdirs, cap * sizeof(uint));
+		if(dirs == NULL) // the walk goes on; walkTree() gives up after it
+		{
+			pthread_mutex_unlock(&w->walklock);
+			__atomic_store_n(&ctx->outofmemory, true, __ATOMIC_RELAXED);
+			__atomic_fetch_sub(&ctx->walkpending, 1, __ATOMIC_ACQ_REL);
+			return;
+		}
+		w->walkdirs = dirs;
+		w->walkcap = cap;
+	}
+	w->walkdirs[w->walktail++] = inum;
+	pthread_mutex_unlock(&w->walklock);
+}
+
+
+// Takes a directory off w's deque: the last one pushed if w is the taker's
+// own, else the first, which is nearest the root and likely has the most
+// under it. Returns false if the deque is empty.
+static bool walkTake(Worker *w, bool own, uint *inum)
+{
+	bool took;
+
+	pthread_mutex_lock(&w->walklock);
+	took = w->walkhead < w->walktail;
+	if(took)
+		*inum = own ? w->walkdirs[--w->walktail] : w->walkdirs[w->walkhead++];
+	if(w->walkhead == w->walktail)
+		w->walkhead = w->walktail = 0;
+	pthread_mutex_unlock(&w->walklock);
+	return took;
+}
+
+
+// Marks what one block of directory inum names as reached, and pushes the
+// directories among them that weren't already.
+static inline __attribute__((always_inline)) bool reachEntries(fcheck_ctx *ctx, int inum, Worker *w, uint k, uint blocknum, struct dirent *de, void *arg)
+{
+	w->blocksread++;
+	for(uint s = 0, n = dirEntries(ctx, inum, k); s < n; s += DSLICE)
+	{
+		Dirscan ds;
+		scanDirBlock(inum, de + s, sliceLen(n, s), &ds);
+		for(uint32_t m = ds.used & ~ds.dot & ~ds.dotdot; m != 0; m &= m - 1)
+		{
+			ushort target = ds.inum[__builtin_ctz(m)];
+			if(target >= ctx->sb->ninodes || inode(ctx, target)->type == 0 || !reach(ctx, target))
+				continue;
+			if(inode(ctx, target)->type == T_DIR && isValidBlock(ctx, inode(ctx, target)->addrs[0]))
+				walkPush(ctx, w, target);
+		}
+	}
+	return false;
+}
+
+
+// Visits directories from its own deque, else from the others', until no
+// directory is left to visit anywhere: walkpending counts a directory from
+// before it is pushed until after what it names is.
+static void *walkWorker(void *arg)
+{
+	Worker *w = arg;
+	fcheck_ctx *ctx = w->ctx;
+	int self = w - ctx->workers;
+	uint inum;
+
+	while(__atomic_load_n(&ctx->walkpending, __ATOMIC_ACQUIRE) > 0)
+	{
+		bool took = walkTake(w, true, &inum);
+		for(int t = 1; !took && t < ctx->nwalkers; t++)
+			took = walkTake(&ctx->workers[(self + t) % ctx->nwalkers], false, &inum);
+		if(!took)
+		{
+			sched_yield();
+			continue;
+		}
+		walkDir(ctx, inum, w, reachEntries, NULL);
+		__atomic_fetch_sub(&ctx->walkpending, 1, __ATOMIC_ACQ_REL);
+	}
+	return NULL;
+}
+
+
+// check 14: Every inode in use can be reached from the root directory.
+// Entries are counted for check 9 wherever they are, so a directory
+// subtree cut off from the rest (with a cycle of directories naming each
+// other at its top) goes unnoticed there.
+//
+// Walks the tree from the root on opts.nthreads workers, following the
+// entries other than . and .. of the directories it reaches. Which inodes
+// are reached doesn't depend on the order, so the result is the same as
+// with a single thread. Left out if check 3 found the root at fault, as
+// nothing would be reached from it.
+static void walkTree(fcheck_ctx *ctx)
+{
+	int nthreads = ctx->opts.nthreads, started = 0;
+	Worker *workers = workersFor(ctx, nthreads);
+	Dinode *root = inode(ctx, ROOTINO);
+
+	if(ctx->checkcount[3] > 0 || root->type != T_DIR || !isValidBlock(ctx, root->addrs[0]))
+		return;
+
+	for(int t = 0; t < nthreads; t++)
+	{
+		workers[t].ctx = ctx;
+		workers[t].walkhead = workers[t].walktail = 0;
+		workers[t].blocksread = 0;
+		pthread_mutex_init(&workers[t].walklock, NULL);
+	}
+	ctx->nwalkers = nthreads;
+	ctx->walkpending = 0;
+	ctx->outofmemory = false;
+
+	reach(ctx, ROOTINO);
+	walkPush(ctx, &workers[0], ROOTINO);
+	if(nthreads > 1)
+		while(started < nthreads && pthread_create(&workers[started].thread, NULL, walkWorker, &workers[started]) == 0)
+			started++;
+	if(started < nthreads) // its deque may have the root, and its thread is this one
+		walkWorker(&workers[started]);
+	for(int t = 0; t < started; t++)
+		pthread_join(workers[t].thread, NULL);
+	for(int t = 0; t < nthreads; t++)
+	{
+		pthread_mutex_destroy(&workers[t].walklock);
+		phaseBytes(ctx, workers[t].blocksread * ctx->geo.bsize);
+	}
+	if(ctx->outofmemory)
+		outOfMemory(ctx);
+
+	// inodes no entry names are check 9's, and those of bad types check 1's
+	phaseBytes(ctx, occupiedInodes(ctx) * sizeof(uint));
+	for(int inum = nextInode(ctx, 1); inum < ctx->sb->ninodes; inum = nextInode(ctx, inum + 1))
+	{
+		if(ctx->inodes.refcount[inum] == 0 || testBit(ctx->inodes.reached, inum))
+			continue;
+		short type = inode(ctx, inum)->type;
+		if(type == T_DIR || type == T_FILE || type == T_DEV)
+			violation(ctx, 14, inum, NOBLOCK, "inode not reachable from the root directory.");
+	}
+}
+
+
+// The checks of the quick level, from the inode table and the bitmap
+// alone: check 1, the root being a directory (check 3), and the number of
+// blocks the bitmap marks in use against the blocks the inodes use (checks
+// 5 and 6). Indirect blocks aren't read, so that is a range: from the
+// blocks the inodes address themselves, up to that and as many more as
+// their sizes call for past the direct ones.
+static void checkQuick(fcheck_ctx *ctx)
+{
+	uint64_t usedmin = 0, usedmax = 0, marked = 0;
+	uint start = dataStart(ctx);
+
+	phaseBytes(ctx, (uint64_t)ctx->sb->ninodes * ctx->geo.inodesize);
+	for(int inum = 0; inum < ctx->sb->ninodes; inum++)
+	{
+		Dinode *dip = inode(ctx, inum);
+
+		if(dip->type != 0 && dip->type != T_DIR && dip->type != T_FILE && dip->type != T_DEV)
+			violation(ctx, 1, inum, NOBLOCK, "bad inode.");
+		else if(dip->type != 0)
+		{
+			uint64_t nblocks = ((uint64_t)dip->size + ctx->geo.bsize - 1) / ctx->geo.bsize;
+			for(uint b = 0; b < ctx->geo.ndirect; b++)
+				usedmin += dip->addrs[b] != 0;
+			if(dip->addrs[ctx->geo.ndirect] != 0)
+			{
+				usedmin++;
+				if(nblocks > ctx->geo.ndirect)
+					usedmax += (nblocks < ctx->geo.maxfile ? nblocks : ctx->geo.maxfile) - ctx->geo.ndirect;
+			}
+		}
+
+		if(inum == ROOTINO && dip->type != T_DIR)
+			violation(ctx, 3, inum, NOBLOCK, "root directory does not exist.");
+	}
+	usedmax += usedmin;
+
+	// bits from the first data block to the last; when blocks are sorted
+	// the bitset is the bitmap itself, with bits past the last block
+	size_t nwords = ((size_t)ctx->sb->size + 63) / 64;
+	phaseBytes(ctx, (nwords - start / 64) * sizeof(uint64_t));
+	for(size_t w = start / 64; w < nwords; w++)
+		marked += __builtin_popcountll(ctx->dblocks.bitset[w]);
+	if(ctx->sb->size % 64 != 0)
+		marked -= __builtin_popcountll(ctx->dblocks.bitset[nwords - 1] & ~(((uint64_t)1 << (ctx->sb->size % 64)) - 1));
+	if(start < ctx->sb->size)
+		marked -= __builtin_popcountll(ctx->dblocks.bitset[start / 64] & (((uint64_t)1 << (start % 64)) - 1));
+
+	ctx->quickcounts[0] = usedmin;
+	ctx->quickcounts[1] = usedmax;
+	ctx->quickcounts[2] = marked;
+	if(marked < usedmin)
+		violation(ctx, 5, -1, NOBLOCK, "bitmap marks fewer blocks in use than the inodes use.");
+	else if(marked > usedmax)
+		violation(ctx, 6, -1, NOBLOCK, "bitmap marks more blocks in use than the inodes use.");
+}
+
+
+// Notes that block blocknum is changed by the repair.
+static void markDirty(fcheck_ctx *ctx, uint blocknum)
+{
+	if(ctx->ndirty == ctx->dirtycap)
+	{
+		ctx->dirtycap = ctx->dirtycap ? 2 * ctx->dirtycap : 64;
+		ctx->dirty = realloc(ctx->dirty, ctx->dirtycap * sizeof(uint64_t));
+		if(ctx->dirty == NULL)
+			outOfMemory(ctx);
+	}
+	ctx->dirty[ctx->ndirty++] = blocknum;
+}
+
+
+// Block blocknum of the shared mapping, to be changed.
+static char *writeBlock(fcheck_ctx *ctx, uint blocknum)
+{
+	markDirty(ctx, blocknum);
+	return ctx->addr + (off_t)blocknum * ctx->geo.bsize;
+}
+
+
+static Dinode *writeInode(fcheck_ctx *ctx, int inum)
+{
+	markDirty(ctx, inum / ctx->geo.ipb + 2);
+	return inode(ctx, inum);
+}
+
+
+// check 2: clears every block address of an in-use inode that is out of the
+// image. Returns how many were cleared.
+static uint clearBadAddresses(fcheck_ctx *ctx)
+{
+	uint cleared = 0;
+
+	for(int inum = 0; inum < ctx->sb->ninodes; inum++)
+	{
+		Dinode *dip = inode(ctx, inum);
+		if(dip->type != T_DIR && dip->type != T_FILE && dip->type != T_DEV)
+			continue;
+
+		for(int b = 0; b <= ctx->geo.ndirect; b++)
+			if(!isValidBlock(ctx, dip->addrs[b]))
+			{
+				writeInode(ctx, inum)->addrs[b] = 0;
+				cleared++;
+			}
+		if(dip->addrs[ctx->geo.ndirect] == 0)
+			continue;
+
+		uint *indirectblock = (uint *) getBlock(ctx, dip->addrs[ctx->geo.ndirect]);
+		for(int index = 0; indirectblock != NULL && index < ctx->geo.nindirect; index++)
+			if(indirectblock[index] != 0 && !isValidBlock(ctx, indirectblock[index]))
+			{
+				((uint *) writeBlock(ctx, dip->addrs[ctx->geo.ndirect]))[index] = 0;
+				cleared++;
+			}
+	}
+	return cleared;
+}
+
+
+// Number of the k-th block of inode inum as xv6 maps it, or 0 if it has none.
+static uint inodeBlock(fcheck_ctx *ctx, int inum, uint k)
+{
+	Blockmap bm;
+
+	blockMap(ctx, inode(ctx, inum), ctx->geo.ndirect, &bm);
+	return blockAt(ctx, &bm, k);
+}
+
+
+// Takes the lowest block no inode uses, zeroed, or returns 0 if there is
+// none in the image.
+static uint allocBlock(fcheck_ctx *ctx)
+{
+	uint datastart = dataStart(ctx);
+
+	if(ctx->nextfree < datastart)
+		ctx->nextfree = datastart;
+	for(; ctx->nextfree < ctx->sb->size; ctx->nextfree++)
+		if(!testBit(ctx->dblocks.referenced, ctx->nextfree) && getBlock(ctx, ctx->nextfree) != NULL)
+		{
+			useBlock(ctx, ctx->nextfree);
+			memset(writeBlock(ctx, ctx->nextfree), 0, ctx->geo.bsize);
+			return ctx->nextfree++;
+		}
+	return 0;
+}
+
+
+// Gives inode inum a new, empty k-th block, and the indirect block if it
+// needs one. Returns 0 if the image is full.
+static uint growInode(fcheck_ctx *ctx, int inum, uint k)
+{
+	uint blocknum;
+
+	if(k < ctx->geo.ndirect)
+	{
+		if((blocknum = allocBlock(ctx)) != 0)
+			writeInode(ctx, inum)->addrs[k] = blocknum;
+		return blocknum;
+	}
+	if(inode(ctx, inum)->addrs[ctx->geo.ndirect] == 0)
+	{
+		uint indirect = allocBlock(ctx);
+		if(indirect == 0)
+			return 0;
+		writeInode(ctx, inum)->addrs[ctx->geo.ndirect] = indirect;
+	}
+	if((blocknum = allocBlock(ctx)) != 0)
+		((uint *) writeBlock(ctx, inode(ctx, inum)->addrs[ctx->geo.ndirect]))[k - ctx->geo.ndirect] = blocknum;
+	return blocknum;
+}
+
+
+// Adds an entry for inode inum to directory dir, in the first free slot or
+// past the last entry. Returns false if the directory can't take it.
+static bool dirLink(fcheck_ctx *ctx, int dir, const char *name, int inum)
+{
+	uint n = inode(ctx, dir)->size / sizeof(struct dirent);
+	struct dirent *de;
+
+	for(uint e = 0; e < n; e++)
+	{
+		uint blocknum = inodeBlock(ctx, dir, e / ctx->geo.dpb);
+		if(blocknum == 0 || (de = (struct dirent *) getBlock(ctx, blocknum)) == NULL)
+			return false;
+		if(de[e % ctx->geo.dpb].inum == 0)
+		{
+			de = (struct dirent *) writeBlock(ctx, blocknum) + e % ctx->geo.dpb;
+			goto found;
+		}
+	}
+
+	if(n >= ctx->geo.maxfile * ctx->geo.dpb)
+		return false;
+	uint blocknum = n % ctx->geo.dpb == 0 ? growInode(ctx, dir, n / ctx->geo.dpb) : inodeBlock(ctx, dir, n / ctx->geo.dpb);
+	if(blocknum == 0 || !isValidBlock(ctx, blocknum))
+		return false;
+	de = (struct dirent *) writeBlock(ctx, blocknum) + n % ctx->geo.dpb;
+	writeInode(ctx, dir)->size = (n + 1) * sizeof(struct dirent);
+
+found:
+	memset(de, 0, sizeof(struct dirent));
+	de->inum = inum;
+	memcpy(de->name, name, strnlen(name, DIRSIZ));
+	return true;
+}
+
+
+// Points the .. entry of directory dir at parent.
+static void setParent(fcheck_ctx *ctx, int dir, int parent)
+{
+	Dircursor c;
+	struct dirent *de;
+	uint blocknum, k;
+
+	dirOpen(ctx, dir, &c);
+	while((de = dirNext(ctx, &c, &blocknum, &k)) != NULL)
+		for(uint e = 0; e < dirEntries(ctx, dir, k); e++)
+			if(de[e].inum != 0 && strncmp(de[e].name, "..", DIRSIZ) == 0)
+			{
+				((struct dirent *) writeBlock(ctx, blocknum))[e].inum = parent;
+				return;
+			}
+}
+
+
+// The lowest free inode that no directory entry names, or 0 if there is none.
+static int allocInode(fcheck_ctx *ctx)
+{
+	uchar *named = calloc(ctx->sb->ninodes, 1);
+	int inum;
+
+	if(named == NULL)
+		outOfMemory(ctx);
+	for(int dir = 0; dir < ctx->sb->ninodes; dir++)
+	{
+		if(inode(ctx, dir)->type != T_DIR || !isValidBlock(ctx, inode(ctx, dir)->addrs[0]))
+			continue;
+		Dircursor c;
+		struct dirent *de;
+		uint blocknum, k;
+
+		dirOpen(ctx, dir, &c);
+		while((de = dirNext(ctx, &c, &blocknum, &k)) != NULL)
+			for(uint e = 0; e < dirEntries(ctx, dir, k); e++)
+				if(de[e].inum < ctx->sb->ninodes)
+					named[de[e].inum] = 1;
+	}
+
+	for(inum = ROOTINO + 1; inum < ctx->sb->ninodes; inum++)
+		if(inode(ctx, inum)->type == 0 && !named[inum])
+			break;
+	free(named);
+	return inum < ctx->sb->ninodes ? inum : 0;
+}
+
+
+// Finds /lost+found, or makes it. Returns 0 if there is no sound root to
+// hang it from or no room for it.
+static int lostAndFound(fcheck_ctx *ctx)
+{
+	Dircursor c;
+	struct dirent *de;
+	int inum;
+	uint blocknum, k;
+
+	if(inode(ctx, ROOTINO)->type != T_DIR || ctx->checkcount[3] > 0)
+		return 0;
+	dirOpen(ctx, ROOTINO, &c);
+	while((de = dirNext(ctx, &c, &blocknum, &k)) != NULL)
+		for(uint e = 0; e < dirEntries(ctx, ROOTINO, k); e++)
+			if(de[e].inum != 0 && de[e].inum < ctx->sb->ninodes &&
+					strncmp(de[e].name, "lost+found", DIRSIZ) == 0 && inode(ctx, de[e].inum)->type == T_DIR)
+				return de[e].inum;
+
+	if((inum = allocInode(ctx)) == 0 || (blocknum = allocBlock(ctx)) == 0)
+		return 0;
+	Dinode *dip = writeInode(ctx, inum);
+	memset(dip, 0, ctx->geo.inodesize);
+	dip->type = T_DIR;
+	dip->nlink = 1;
+	dip->size = 2 * sizeof(struct dirent);
+	dip->addrs[0] = blocknum;
+
+	de = (struct dirent *) writeBlock(ctx, blocknum);
+	de[0].inum = inum;
+	strcpy(de[0].name, ".");
+	de[1].inum = ROOTINO;
+	strcpy(de[1].name, "..");
+
+	if(!dirLink(ctx, ROOTINO, "lost+found", inum))
+	{
+		memset(writeInode(ctx, inum), 0, ctx->geo.inodesize);
+		return 0;
+	}
+	ctx->inodes.refcount[inum] = 1;
+	return inum;
+}
+
+
+// check 9: links every in-use inode no directory names into lost+found as
+// #inum. Returns how many were linked, and leaves in *left how many could
+// not be.
+static uint reattachOrphans(fcheck_ctx *ctx, uint *left)
+{
+	int lostfound = -1; // not looked for yet
+	uint linked = 0;
+
+	*left = 0;
+	for(int inum = ROOTINO + 1; inum < ctx->sb->ninodes; inum++)
+	{
+		short type = inode(ctx, inum)->type;
+		if((type != T_DIR && type != T_FILE && type != T_DEV) || ctx->inodes.refcount[inum] > 0)
+			continue;
+
+		char name[DIRSIZ + 1];
+		snprintf(name, sizeof(name), "#%d", inum);
+		if(lostfound < 0)
+			lostfound = lostAndFound(ctx);
+		if(lostfound != 0 && dirLink(ctx, lostfound, name, inum))
+		{
+			ctx->inodes.refcount[inum]++;
+			if(type == T_DIR)
+				setParent(ctx, inum, lostfound);
+			linked++;
+		}
+		else
+			(*left)++;
+	}
+	return linked;
+}
+
+
+// check 11: sets the link count of every file to the entries naming it.
+static uint fixLinkCounts(fcheck_ctx *ctx)
+{
+	uint fixed = 0;
+
+	for(int inum = 1; inum < ctx->sb->ninodes; inum++)
+		if(inode(ctx, inum)->type == T_FILE && inode(ctx, inum)->nlink != ctx->inodes.refcount[inum])
+		{
+			writeInode(ctx, inum)->nlink = ctx->inodes.refcount[inum];
+			fixed++;
+		}
+	return fixed;
+}
+
+
+// checks 5 and 6: rewrites the bitmap as the blocks before the data blocks
+// plus those in use, a bitmap block at a time, and only the blocks that
+// differ. Returns how many were rewritten.
+static uint rebuildBitmap(fcheck_ctx *ctx)
+{
+	uint bitmapstart = bitmapStart(ctx);
+	uint datastart = dataStart(ctx);
+	uint rewritten = 0;
+	uchar want[MAXBSIZE];
+
+	for(uint b = 0; b < ctx->sb->size; b += ctx->geo.bpb)
+	{
+		uint nbits = ctx->sb->size - b < ctx->geo.bpb ? ctx->sb->size - b : ctx->geo.bpb;
+		uchar *have = (uchar *) getBlock(ctx, bitmapstart + b / ctx->geo.bpb);
+		if(have == NULL) // past the end of the image
+			continue;
+
+		memcpy(want, have, ctx->geo.bsize); // keeps what lies past the last block
+		memcpy(want, (char *) ctx->dblocks.referenced + b / 8, nbits / 8);
+		for(uint bit = nbits / 8 * 8; bit < nbits; bit++)
+			want[bit / 8] = (want[bit / 8] & ~(1 << bit % 8)) |
+					testBit(ctx->dblocks.referenced, b + bit) << bit % 8;
+		for(uint bit = b; bit < datastart && bit < b + nbits; bit++)
+			want[(bit - b) / 8] |= 1 << (bit - b) % 8;
+
+		if(memcmp(want, have, ctx->geo.bsize) != 0)
+		{
+			memcpy(writeBlock(ctx, bitmapstart + b / ctx->geo.bpb), want, ctx->geo.bsize);
+			rewritten++;
+		}
+	}
+	return rewritten;
+}
+
+
+// Writes the changed blocks back: each once, in block order, with one
+// msync() over the pages from the first to the last. Returns how many.
+static size_t flushRepairs(fcheck_ctx *ctx)
+{
+	size_t n = 0;
+
+	if(ctx->ndirty == 0)
+		return 0;
+	qsort(ctx->dirty, ctx->ndirty, sizeof(uint64_t), cmpU64);
+	for(size_t i = 0; i < ctx->ndirty; i++)
+		if(n == 0 || ctx->dirty[i] != ctx->dirty[n - 1])
+			ctx->dirty[n++] = ctx->dirty[i];
+	ctx->ndirty = n;
+
+	off_t pagesize = sysconf(_SC_PAGESIZE);
+	off_t start = (off_t)ctx->dirty[0] * ctx->geo.bsize / pagesize * pagesize;
+	off_t end = (off_t)(ctx->dirty[n - 1] + 1) * ctx->geo.bsize;
+	if(msync(ctx->addr + start, end - start, MS_SYNC) != 0)
+		systemError(ctx, "msync failed");
+	return n;
+}
+
+
+// Finds an entry naming each inode, for paths: the first in the
+// directories in inode order, leaving out . and .. and the root. Nothing is
+// kept of clean images, so this is left until a path is asked for.
+static void pathIndex(fcheck_ctx *ctx)
+{
+	if((ctx->pathlinks = calloc(ctx->sb->ninodes, sizeof(Pathlink))) == NULL)
+		return;
+
+	for(int inum = nextInode(ctx, ROOTINO); inum < ctx->sb->ninodes; inum = nextInode(ctx, inum + 1))
+	{
+		Dircursor c;
+		struct dirent *de;
+		uint blocknum, k;
+
+		if(inode(ctx, inum)->type != T_DIR || !isValidBlock(ctx, inode(ctx, inum)->addrs[0]))
+			continue;
+		dirOpen(ctx, inum, &c);
+		while((de = dirNext(ctx, &c, &blocknum, &k)) != NULL)
+			for(uint e = 0, n = dirEntries(ctx, inum, k); e < n; e++)
+			{
+				ushort target = de[e].inum;
+				if(target == 0 || target == ROOTINO || target >= ctx->sb->ninodes || ctx->pathlinks[target].parent != 0 ||
+						strncmp(de[e].name, ".", DIRSIZ) == 0 || strncmp(de[e].name, "..", DIRSIZ) == 0)
+					continue;
+				ctx->pathlinks[target] = (Pathlink){inum, k * ctx->geo.dpb + e};
+			}
+	}
+}
+
+
+// Frees what only the image just checked needed: the checkpoint as read.
+static void stateReset(fcheck_ctx *ctx)
+{
+	free(ctx->olddirs);
+	free(ctx->oldtargets);
+	free(ctx->olddir);
+	free(ctx->oldrefcount);
+	free(ctx->mentions);
+	free(ctx->dirhash);
+	ctx->olddirs = NULL;
+	ctx->oldtargets = NULL;
+	ctx->olddir = ctx->oldrefcount = ctx->mentions = NULL;
+	ctx->dirhash = NULL;
+	ctx->nolddirs = 0;
+	ctx->nnotes = 0;
+	ctx->incremental = false;
+}
+
+
+// Frees the buffers kept from one image to the next.
+static void buffersFree(fcheck_ctx *ctx)
+{
+	for(int t = 0; t < ctx->nworkers; t++)
+	{
+		free(ctx->workers[t].dirblocks);
+		free(ctx->workers[t].walkdirs);
+		free(ctx->workers[t].uses);
+	}
+	free(ctx->runs);
+	free(ctx->merge.buf);
+	free(ctx->merge.at);
+	free(ctx->merge.len);
+	free(ctx->suspects);
+	free(ctx->seen);
+	ctx->runs = NULL;
+	ctx->runscap = 0;
+	ctx->merge = (Merge){0};
+	ctx->suspects = NULL;
+	ctx->seen = NULL;
+	ctx->suspectscap = 0;
+	free(ctx->workers);
+	free(ctx->dirblocks);
+	free(ctx->sortbuf);
+	free(ctx->headbuf);
+	free(ctx->stored);
+	free(ctx->storeddata);
+	free(ctx->slots);
+	free(ctx->pending);
+	free(ctx->window);
+	free(ctx->longdirs);
+	free(ctx->notes);
+	free(ctx->dirty);
+	free(ctx->names.slots);
+	ctx->workers = NULL;
+	ctx->nworkers = 0;
+	ctx->dirblocks = ctx->sortbuf = NULL;
+	ctx->dirblockscap = 0;
+	ctx->headbuf = ctx->window = NULL;
+	ctx->windowsize = 0;
+	ctx->stored = ctx->slots = ctx->pending = NULL;
+	ctx->storeddata = NULL;
+	ctx->storedcap = ctx->nslots = ctx->pendingcap = 0;
+	ctx->storeddatacap = 0;
+	ctx->longdirs = ctx->notes = ctx->dirty = NULL;
+	ctx->longdirscap = ctx->notescap = ctx->dirtycap = 0;
+	ctx->names.slots = NULL;
+	ctx->names.nslots = 0;
+	if(ctx->arena != NULL)
+		munmap(ctx->arena, ctx->arenasize);
+	ctx->arena = NULL;
+	ctx->arenasize = 0;
+}
+
+
+fcheck_ctx *fcheck_new(void)
+{
+	fcheck_ctx *ctx = calloc(1, sizeof(fcheck_ctx));
+
+	if(ctx == NULL)
+		return NULL;
+	ctx->imagefd = -1;
+	ctx->counterfd[0] = ctx->counterfd[1] = -2; // not opened yet
+	pthread_mutex_init(&ctx->errlock, NULL);
+	pthread_mutex_init(&ctx->runlock, NULL);
+	return ctx;
+}
+
+
+int fcheck_open(fcheck_ctx *ctx, const char *path, const fcheck_opts *opts)
+{
+	struct stat statbuf;
+	bool streaming;
+
+	fcheck_reset(ctx);
+	if(opts != NULL)
+		ctx->opts = *opts;
+	if(ctx->opts.nthreads < 1)
+		ctx->opts.nthreads = 1;
+	if(ctx->opts.repair) // needs all of the state, in memory
+	{
+		ctx->opts.all = true;
+		ctx->opts.memlimit = 0;
+	}
+	streaming = ctx->opts.stream;
+
+	if((ctx->imagepath = strdup(path)) == NULL)
+	{
+		ctx->error = "out of memory.";
+		return FCHECK_ENOMEM;
+	}
+
+	if(strcmp(path, "-") == 0 && ctx->opts.repair)
+	{
+		ctx->error = "cannot repair an image that can't be mapped.";
+		return FCHECK_ESYS;
+	}
+	if(strcmp(path, "-") == 0)
+		ctx->imagefd = STDIN_FILENO;
+	else
+	{
+		ctx->imagefd = open(path, ctx->opts.repair ? O_RDWR : O_RDONLY);
+		ctx->ownfd = ctx->imagefd >= 0;
+	}
+	if(ctx->imagefd < 0 && ctx->opts.repair && errno != ENOENT)
+	{
+		snprintf(ctx->errbuf, sizeof(ctx->errbuf), "cannot open image to repair: %s", strerror(errno));
+		ctx->error = ctx->errbuf;
+		return FCHECK_ENOENT;
+	}
+	if(ctx->imagefd < 0){
+		ctx->error = "image not found.";
+		return FCHECK_ENOENT;
+	}
+
+	/*DONE: Dont hard code the size of file. Use fstat to get the size */
+	if(fstat(ctx->imagefd, &statbuf) != 0)
+	{
+		snprintf(ctx->errbuf, sizeof(ctx->errbuf), "fstat failed: %s", strerror(errno));
+		ctx->error = ctx->errbuf;
+		return FCHECK_ESYS;
+	}
+
+	ctx->imagesize = statbuf.st_size;
+
+	// map the image if possible, otherwise (a pipe, or too big for the
+	// address space) stream it. A repair changes the image in place, so it
+	// must be mapped.
+	if((!streaming || ctx->opts.repair) && S_ISREG(statbuf.st_mode))
+	{
+		ctx->addr = ctx->opts.repair ?
+				mmap(NULL, ctx->imagesize, PROT_READ | PROT_WRITE, MAP_SHARED, ctx->imagefd, 0) :
+				mmap(NULL, ctx->imagesize, PROT_READ, MAP_PRIVATE, ctx->imagefd, 0);
+		streaming = ctx->addr == MAP_FAILED;
+		if(streaming)
+			ctx->addr = NULL;
+	}
+	else
+		streaming = true;
+
+	if(streaming && ctx->opts.repair)
+	{
+		ctx->error = "cannot repair an image that can't be mapped.";
+		return FCHECK_ESYS;
+	}
+
+	if(streaming)
+	{
+		ctx->seekable = lseek(ctx->imagefd, 0, SEEK_CUR) != -1;
+		ctx->image = (Image){streamHead, streamBlock, streamAdvise};
+	}
+	else
+		ctx->image = (Image){mmapHead, mmapBlock, mmapAdvise};
+	return FCHECK_OK;
+}
+
+
+int fcheck_check(fcheck_ctx *ctx)
+{
+	int result;
+
+	if(ctx->imagepath == NULL)
+	{
+		ctx->error = "no image open.";
+		return FCHECK_ENOENT;
+	}
+
+	if(ctx->opts.stats)
+		statsInit(ctx);
+
+	if((result = setjmp(ctx->unwind)) != 0)
+	{
+		if(result == FCHECK_ENOMEM) // some buffer may be lost
+			buffersFree(ctx);
+		startPhase(ctx, NULL);
+		return result;
+	}
+
+	readHead(ctx);
+	if(ctx->opts.level == FCHECK_QUICK)
+	{
+		startPhase(ctx, "quick");
+		checkQuick(ctx);
+	}
+	else
+	{
+		bool unchanged = false;
+
+		if(ctx->image.head == streamHead)
+		{
+			startPhase(ctx, "gather");
+			gatherBlocks(ctx);
+			phaseBytes(ctx, (uint64_t)ctx->nstored * ctx->geo.bsize);
+		}
+
+		if(ctx->opts.statepath != NULL)
+		{
+			startPhase(ctx, "digest");
+			unchanged = loadState(ctx);
+		}
+
+		if(!unchanged)
+		{
+			checkInodes(ctx, ctx->opts.nthreads, false);
+
+			startPhase(ctx, "bitmap");
+			checkBitmap(ctx);
+
+			startPhase(ctx, "links");
+			checkLinks(ctx);
+
+			startPhase(ctx, "tree");
+			walkTree(ctx);
+
+			if(ctx->opts.statepath != NULL && ctx->nviolations == 0)
+			{
+				startPhase(ctx, "state");
+				saveState(ctx);
+			}
+		}
+	}
+	startPhase(ctx, NULL);
+	ctx->checked = ctx->opts.level != FCHECK_QUICK; // all a repair needs
+
+	if(ctx->nviolations > 0)
+	{
+		snprintf(ctx->errbuf, sizeof(ctx->errbuf), "%u violations found.", ctx->nviolations);
+		ctx->error = ctx->errbuf;
+		return FCHECK_VIOLATION;
+	}
+	return FCHECK_OK;
+}
+
+
+int fcheck_repair(fcheck_ctx *ctx, FILE *log)
+{
+	uint cleared, linked, left, fixed, rewritten, unfixable = 0;
+	size_t written;
+	int result;
+
+	if(!ctx->opts.repair || !ctx->checked)
+	{
+		ctx->error = "image not checked for repair.";
+		return FCHECK_ENOENT;
+	}
+
+	// everything the repair works out hangs off the superblock and the
+	// root, so with either bad nothing is written
+	if(ctx->checkcount[0] > 0 || inode(ctx, ROOTINO)->type != T_DIR)
+	{
+		ctx->error = "superblock or root directory bad, image not repaired.";
+		return FCHECK_VIOLATION;
+	}
+
+	if((result = setjmp(ctx->unwind)) != 0)
+	{
+		if(result == FCHECK_ENOMEM)
+			buffersFree(ctx);
+		return result;
+	}
+
+	ctx->ndirty = 0;
+	free(ctx->pathlinks); // directories are about to change
+	ctx->pathlinks = NULL;
+	ctx->screened = false; // and inodes, for /lost+found
+	cleared = clearBadAddresses(ctx);
+	linked = reattachOrphans(ctx, &left);
+	fixed = fixLinkCounts(ctx);
+	rewritten = rebuildBitmap(ctx);
+	written = flushRepairs(ctx);
+
+	if(log != NULL)
+	{
+		if(cleared > 0)
+			fprintf(log, "repaired: %u bad block addresses cleared\n", cleared);
+		if(linked > 0)
+			fprintf(log, "repaired: %u lost inodes linked into lost+found\n", linked);
+		if(fixed > 0)
+			fprintf(log, "repaired: %u file link counts fixed\n", fixed);
+		if(rewritten > 0)
+			fprintf(log, "repaired: %u bitmap blocks rebuilt\n", rewritten);
+		fprintf(log, "repaired: %zu blocks written\n", written);
+	}
+
+	// the checks it doesn't repair
+	int unfixed[] = {0, 1, 3, 4, 7, 8, 10, 12, 13, 14};
+	for(size_t c = 0; c < sizeof(unfixed) / sizeof(unfixed[0]); c++)
+		unfixable += ctx->checkcount[unfixed[c]];
+	unfixable += left;
+	if(unfixable > 0)
+	{
+		snprintf(ctx->errbuf, sizeof(ctx->errbuf), "%u violations left that repair can't fix.", unfixable);
+		ctx->error = ctx->errbuf;
+		return FCHECK_VIOLATION;
+	}
+	ctx->error = NULL;
+	return FCHECK_OK;
+}
+
+
+const char *fcheck_error(fcheck_ctx *ctx)
+{
+	return ctx->error != NULL ? ctx->error : "";
+}
+
+
+// Follows the entries naming inum and its directories back to the root,
+// writing the names from the end of pathbuf. A path that doesn't get there,
+// or too long for pathbuf as one going round a cycle would be, is none.
+// The quick level doesn't read directories, so it has no paths past the root.
+const char *fcheck_path(fcheck_ctx *ctx, int inum)
+{
+	char *p = ctx->pathbuf + sizeof(ctx->pathbuf) - 1;
+
+	if(ctx->itable == NULL || inum < 0 || inum >= ctx->sb->ninodes)
+		return NULL;
+	if(inum == ROOTINO)
+		return "/";
+	if(ctx->opts.level == FCHECK_QUICK)
+		return NULL;
+	if(ctx->pathlinks == NULL)
+		pathIndex(ctx);
+	if(ctx->pathlinks == NULL)
+		return NULL;
+
+	*p = '\0';
+	while(inum != ROOTINO)
+	{
+		Pathlink *l = &ctx->pathlinks[inum];
+		if(l->parent == 0)
+			return NULL;
+
+		struct dirent *de = (struct dirent *) getBlock(ctx, inodeBlock(ctx, l->parent, l->entry / ctx->geo.dpb));
+		if(de == NULL)
+			return NULL;
+		de += l->entry % ctx->geo.dpb;
+		size_t len = strnlen(de->name, DIRSIZ);
+		if((size_t)(p - ctx->pathbuf) < len + 1)
+			return NULL;
+		p -= len;
+		memcpy(p, de->name, len);
+		*--p = '/';
+		inum = l->parent;
+	}
+	return p;
+}
+
+
+// Prints the violations opts.all collected and a per-check summary.
+void fcheck_report(fcheck_ctx *ctx, FILE *out)
+{
+	uint kept = ctx->nviolations < RINGSIZE ? ctx->nviolations : RINGSIZE;
+
+	qsort(ctx->ring, kept, sizeof(Violation), cmpViolation);
+	for(uint v = 0; v < kept; v++)
+	{
+		const char *path = fcheck_path(ctx, ctx->ring[v].inum);
+
+		fprintf(out, "ERROR: %s ", ctx->ring[v].msg);
+		if(path != NULL)
+			fprintf(out, "%s ", path);
+		fprintf(out, "(check %d", ctx->ring[v].check);
+		if(ctx->ring[v].inum >= 0)
+			fprintf(out, ", inode %d", ctx->ring[v].inum);
+		if(ctx->ring[v].block != NOBLOCK)
+			fprintf(out, ", block %u", ctx->ring[v].block);
+		fprintf(out, ")\n");
+	}
+	if(ctx->nviolations == 0)
+		return;
+	if(ctx->nviolations > kept)
+		fprintf(out, "%u more violations not shown\n", ctx->nviolations - kept);
+
+	for(int c = 0; c <= 14; c++)
+		if(ctx->checkcount[c] > 0)
+			fprintf(out, "check %d: %u violations\n", c, ctx->checkcount[c]);
+	fprintf(out, "%u violations found\n", ctx->nviolations);
+}
+
+
+// Prints s as a JSON string. Bytes from 0x7f up are escaped as the
+// Latin-1 characters they would be, so the output is UTF-8 whatever s is.
+static void jsonString(FILE *out, const char *s)
+{
+	fputc('"', out);
+	for(; s != NULL && *s != '\0'; s++)
+	{
+		uchar c = *s;
+		if(c == '"' || c == '\\')
+			fprintf(out, "\\%c", c);
+		else if(c < ' ' || c >= 0x7f)
+			fprintf(out, "\\u%04x", c);
+		else
+			fputc(c, out);
+	}
+	fputc('"', out);
+}
+
+
+// The fields of a phase, as JSON
+static void phaseFields(FILE *out, Phase *p, bool perf)
+{
+	fprintf(out, "\"name\": \"%s\", \"seconds\": %.6f, \"bytes\": %llu, \"minflt\": %ld, \"majflt\": %ld",
+			p->name, p->seconds, (unsigned long long) p->bytes, p->minflt, p->majflt);
+	if(perf)
+		fprintf(out, ", \"cycles\": %llu, \"cache_misses\": %llu",
+				(unsigned long long) p->counters[0], (unsigned long long) p->counters[1]);
+}
+
+
+// What the check of a violation compared, where it is a number: what it
+// expected, and what the image has. Returns which of them there are.
+#define HAS_EXPECTED 1
+#define HAS_ACTUAL   2
+static int violationValues(fcheck_ctx *ctx, Violation *v, long long *expected, long long *actual)
+{
+	switch(v->check)
+	{
+	case 1: // the type of the inode
+		*actual = inode(ctx, v->inum)->type;
+		return HAS_ACTUAL;
+	case 5: // the bit of the block in the bitmap, or at the quick level the
+		// blocks it marks against those the inodes use at least
+		*expected = v->block != NOBLOCK ? 1 : (long long)ctx->quickcounts[0];
+		*actual = v->block != NOBLOCK ? 0 : (long long)ctx->quickcounts[2];
+		return HAS_EXPECTED | HAS_ACTUAL;
+	case 6: // and at most
+		*expected = v->block != NOBLOCK ? 0 : (long long)ctx->quickcounts[1];
+		*actual = v->block != NOBLOCK ? 1 : (long long)ctx->quickcounts[2];
+		return HAS_EXPECTED | HAS_ACTUAL;
+	case 9: // the entries naming the inode
+		*actual = 0;
+		return HAS_ACTUAL;
+	case 11: // the entries naming the file, and its link count
+		*expected = ctx->inodes.refcount[v->inum];
+		*actual = inode(ctx, v->inum)->nlink;
+		return HAS_EXPECTED | HAS_ACTUAL;
+	case 12: // the entries naming the directory
+		*expected = 1;
+		*actual = ctx->inodes.refcount[v->inum];
+		return HAS_EXPECTED | HAS_ACTUAL;
+	}
+	return 0;
+}
+
+
+// Prints the last check as NDJSON: a record for each phase, for each
+// violation kept, in the order of fcheck_report(), and one for the result.
+// Every record has the image, so those of many images can be mixed.
+void fcheck_ndjson(fcheck_ctx *ctx, FILE *out, int result)
+{
+	uint kept = ctx->nviolations < RINGSIZE ? ctx->nviolations : RINGSIZE;
+	bool perf = ctx->counterfd[0] >= 0;
+	double seconds = 0;
+
+	for(int i = 0; i < ctx->nphases; i++)
+	{
+		fprintf(out, "{\"type\": \"phase\", \"image\": ");
+		jsonString(out, ctx->imagepath);
+		fprintf(out, ", ");
+		phaseFields(out, &ctx->phases[i], perf);
+		fprintf(out, "}\n");
+		seconds += ctx->phases[i].seconds;
+	}
+
+	if(result >= 0)
+		qsort(ctx->ring, kept, sizeof(Violation), cmpViolation);
+	for(uint i = 0; i < kept && result >= 0; i++)
+	{
+		Violation *v = &ctx->ring[i];
+		long long expected = 0, actual = 0;
+		int values = violationValues(ctx, v, &expected, &actual);
+
+		fprintf(out, "{\"type\": \"violation\", \"image\": ");
+		jsonString(out, ctx->imagepath);
+		fprintf(out, ", \"check\": %d, \"message\": ", v->check);
+		jsonString(out, v->msg);
+		if(v->inum >= 0)
+			fprintf(out, ", \"inode\": %d", v->inum);
+		if(v->block != NOBLOCK)
+			fprintf(out, ", \"block\": %u", v->block);
+		if(v->inum >= 0 && fcheck_path(ctx, v->inum) != NULL)
+		{
+			fprintf(out, ", \"path\": ");
+			jsonString(out, fcheck_path(ctx, v->inum));
+		}
+		if(values & HAS_EXPECTED)
+			fprintf(out, ", \"expected\": %lld", expected);
+		if(values & HAS_ACTUAL)
+			fprintf(out, ", \"actual\": %lld", actual);
+		fprintf(out, "}\n");
+	}
+
+	fprintf(out, "{\"type\": \"result\", \"image\": ");
+	jsonString(out, ctx->imagepath);
+	fprintf(out, ", \"result\": \"%s\"", result == FCHECK_OK ? "ok" : result == FCHECK_VIOLATION ? "violation" : "error");
+	if(result != FCHECK_OK)
+	{
+		fprintf(out, ", \"message\": ");
+		jsonString(out, fcheck_error(ctx));
+	}
+	if(result >= 0)
+	{
+		fprintf(out, ", \"violations\": %u, \"unlisted\": %u, \"checks\": {", ctx->nviolations, ctx->nviolations - kept);
+		for(int c = 0, n = 0; c <= 14; c++)
+			if(ctx->checkcount[c] > 0)
+				fprintf(out, "%s\"%d\": %u", n++ ? ", " : "", c, ctx->checkcount[c]);
+		fprintf(out, "}");
+	}
+	fprintf(out, ", \"seconds\": %.6f}\n", seconds);
+}
+
+
+// Prints the phases of the last check, as a table or as one JSON object.
+void fcheck_stats(fcheck_ctx *ctx, FILE *out, bool json)
+{
+	Phase total = {.name = "total"};
+	bool perf = ctx->counterfd[0] >= 0;
+	struct superblock *sb = ctx->imagepath != NULL ? ctx->sb : NULL;
+
+	for(int i = 0; i < ctx->nphases; i++)
+	{
+		total.seconds += ctx->phases[i].seconds;
+		total.bytes += ctx->phases[i].bytes;
+		total.minflt += ctx->phases[i].minflt;
+		total.majflt += ctx->phases[i].majflt;
+		for(int c = 0; c < 2; c++)
+			total.counters[c] += ctx->phases[i].counters[c];
+	}
+	ctx->phases[ctx->nphases] = total;
+
+	if(json)
+	{
+		fprintf(out, "{\"image\": ");
+		jsonString(out, ctx->imagepath);
+		fprintf(out, ", \"blocks\": %u, \"inodes\": %u, \"phases\": [",
+				sb ? sb->size : 0, sb ? sb->ninodes : 0);
+		for(int i = 0; i <= ctx->nphases; i++)
+		{
+			fprintf(out, "%s\n  {", i ? "," : "");
+			phaseFields(out, &ctx->phases[i], perf);
+			fprintf(out, "}");
+		}
+		fprintf(out, "\n]}\n");
+		return;
+	}
+
+	fprintf(out, "%-12s %10s %14s %8s %8s %14s %14s\n",
+			"phase", "seconds", "bytes", "minflt", "majflt", "cycles", "cache-misses");
+	for(int i = 0; i <= ctx->nphases; i++)
+	{
+		Phase *p = &ctx->phases[i];
+		fprintf(out, "%-12s %10.6f %14llu %8ld %8ld", p->name, p->seconds,
+				(unsigned long long) p->bytes, p->minflt, p->majflt);
+		if(perf)
+			fprintf(out, " %14llu %14llu\n", (unsigned long long) p->counters[0], (unsigned long long) p->counters[1]);
+		else
+			fprintf(out, " %14s %14s\n", "-", "-");
+	}
+}
+
+
+// Closes the image and forgets it, keeping the buffers for the next one.
+void fcheck_reset(fcheck_ctx *ctx)
+{
+	if(ctx->addr != NULL)
+		munmap(ctx->addr, ctx->imagesize);
+	if(ctx->ownfd)
+		close(ctx->imagefd);
+	free(ctx->imagepath);
+	free(ctx->pathlinks);
+	stateReset(ctx);
+	closeRuns(ctx);
+
+	ctx->imagepath = NULL;
+	ctx->pathlinks = NULL;
+	ctx->addr = NULL;
+	ctx->imagefd = -1;
+	ctx->ownfd = false;
+	ctx->imagesize = 0;
+	ctx->seekable = false;
+	ctx->streampos = 0;
+	ctx->headlen = 0;
+	ctx->nstored = 0;
+	if(ctx->nslots > 0)
+		memset(ctx->slots, 0, ctx->nslots * sizeof(uint));
+	ctx->npending = 0;
+	ctx->sb = NULL;
+	ctx->itable = NULL;
+	ctx->checked = false;
+	ctx->screened = false;
+	ctx->ndirty = 0;
+	ctx->nextfree = 0;
+	ringReset(ctx);
+	ctx->nphases = 0;
+	ctx->error = NULL;
+}
+
+
+void fcheck_free(fcheck_ctx *ctx)
+{
+	if(ctx == NULL)
+		return;
+	fcheck_reset(ctx);
+	buffersFree(ctx);
+	for(int c = 0; c < 2; c++)
+		if(ctx->counterfd[c] >= 0)
+			close(ctx->counterfd[c]);
+	pthread_mutex_destroy(&ctx->errlock);
+	pthread_mutex_destroy(&ctx->runlock);
+	free(ctx);
+}
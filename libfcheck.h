@@ -0,0 +1,92 @@
+#ifndef _LIBFCHECK_H_
+#define _LIBFCHECK_H_
+
+#include <stdio.h>
+#include <stdbool.h>
+
+// Checks xv6 file system images from inside a program, as fcheck does from
+// the command line. A context holds everything a check works on, and can be
+// used for one image after another, keeping what it allocated. Contexts are
+// independent, so threads can each check with their own; a context is only
+// ever used by one thread at a time.
+//
+//	fcheck_ctx *ctx = fcheck_new();
+//	int result = fcheck_open(ctx, "fs.img", &opts);
+//	if(result == FCHECK_OK)
+//		result = fcheck_check(ctx);
+//	if(result != FCHECK_OK)
+//		fprintf(stderr, "%s\n", fcheck_error(ctx));
+//	fcheck_free(ctx);
+
+typedef struct fcheck_ctx fcheck_ctx;
+
+typedef struct fcheck_opts{
+	int nthreads;          // threads for the per-inode checks; less than 1 is 1
+	bool all;              // collect every violation instead of stopping at the first
+	bool stream;           // stream the image even if it could be mapped
+	const char *statepath; // checkpoint to check from and then update, or NULL
+	bool stats;            // time the phases of the check, for fcheck_stats()
+	bool repair;           // open the image to be changed by fcheck_repair(); implies all
+	unsigned bsize;        // block size, a power of 2 from 512 to 4096, or 0 to tell from the image
+	unsigned ndirect;      // direct addresses per inode, up to 32, or 0 for 12 (with bsize only)
+	int level;             // how much is checked: one of the levels below
+	size_t memlimit;       // bytes of checker state past which block uses are sorted in temporary files, or 0 for no limit; not with repair
+}fcheck_opts;
+
+#define FCHECK_NORMAL 0 // every check, from a checkpoint if there is one
+#define FCHECK_QUICK  1 // the inode table, bitmap and superblock only; no repair
+#define FCHECK_FULL   2 // every check and the superblock, ignoring a checkpoint
+
+#define FCHECK_OK         0  // the image is consistent
+#define FCHECK_VIOLATION  1  // it is not: fcheck_error() has the first violation, or with all, fcheck_report() every one
+#define FCHECK_ENOENT    -1  // the image can't be opened
+#define FCHECK_ETOOSMALL -2  // the image is too small for its superblock
+#define FCHECK_ESYS      -3  // a system call failed
+#define FCHECK_ENOMEM    -4  // out of memory
+
+// NULL if out of memory.
+fcheck_ctx *fcheck_new(void);
+
+// Opens the image at path, "-" for stdin, to be checked with opts. Whatever
+// the context had open is closed first.
+int fcheck_open(fcheck_ctx *ctx, const char *path, const fcheck_opts *opts);
+
+// Checks the open image. Returns one of the results above.
+int fcheck_check(fcheck_ctx *ctx);
+
+// Repairs what the check found, in place: clears block addresses out of the
+// image (check 2), links inodes no directory names into /lost+found (check
+// 9), sets the link counts of files (check 11) and rebuilds the bitmap
+// (checks 5 and 6). Only changed blocks are written. What it did is
+// printed on log unless NULL. Returns FCHECK_VIOLATION if violations of
+// other checks are left.
+int fcheck_repair(fcheck_ctx *ctx, FILE *log);
+
+// What the last result was about, as the fcheck tool words it.
+const char *fcheck_error(fcheck_ctx *ctx);
+
+// Prints the violations collected with all, each with the path of its
+// inode if it has one, and a count per check.
+void fcheck_report(fcheck_ctx *ctx, FILE *out);
+
+// The path of inode inum in the open image, as its directories name it, or
+// NULL if no path from the root does or, past the root, at the quick level.
+// The first call looks through all the directories; the string is good
+// until the next call.
+const char *fcheck_path(fcheck_ctx *ctx, int inum);
+
+// Prints the last check, whose result was result, as NDJSON: one JSON
+// object a line for each phase timed with stats, for each violation
+// collected with all, and one for the result.
+void fcheck_ndjson(fcheck_ctx *ctx, FILE *out, int result);
+
+// Prints what each phase of the last check cost, with stats. Page faults
+// are counted for the whole process.
+void fcheck_stats(fcheck_ctx *ctx, FILE *out, bool json);
+
+// Closes the image. Buffers are kept for the next one.
+void fcheck_reset(fcheck_ctx *ctx);
+
+void fcheck_free(fcheck_ctx *ctx);
+
+#endif // _LIBFCHECK_H_
@@ -0,0 +1,376 @@
+#define _FILE_OFFSET_BITS 64 // images over 2 GB on 32-bit builds too
+
+// Builds a valid xv6 file system image to test and benchmark fcheck with: a
+// directory tree of the given fan-out and depth, filled with files of random
+// size until the inodes run out or the tree is as deep as asked. Only the metadata is written; file contents
+// are left as holes, so even huge images take little time and disk.
+
+#include <stdio.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "types.h"
+#include "fs.h"
+
+
+#define T_DIR  1   // Directory
+#define T_FILE 2   // File
+
+#define MAXINUM 65535 // the largest inode number a dirent can hold
+
+#define MAXBSIZE 4096
+#define GEOMAGIC 0x6d6f6567 // after the superblock, ahead of the block size and NDIRECT
+
+
+// An entry of a directory. The entries of one directory are kept together,
+// "." and ".." first.
+typedef struct Entry{
+	uint inum;
+	uint index; // within its directory, for its name
+}Entry;
+
+struct dinode *dip; // the inode table
+uint *nfileblocks;  // blocks each file is to get
+uint *firstentry;   // first entry of each directory
+uint *nentries;     // and how many it has
+
+Entry *entries;
+size_t nentry, entrycap;
+
+uint blocksize = BSIZE;
+uint size, ninodes;
+uint nextinode = ROOTINO; // next free inode
+uint nextblock;           // next free data block
+uint ndirs, nfiles, nlinks, nindirect;
+
+int fd;
+
+// parameters
+uint fanout = 16;           // entries per directory
+uint depth = 4;             // levels of directories below the root
+double dirratio = 0.1;      // share of new entries that are directories
+double linkratio = 0.05;    // share of entries that are hard links
+double meanblocks = 4;      // mean size of a small file, in blocks
+double indirectratio = 0.05; // share of files using the indirect block
+uint64_t seed = 1;
+
+
+void usage(void)
+{
+	fprintf(stderr, "Usage: mkimage [-B blocksize] [-b blocks] [-i inodes] [-f fanout] [-d depth] [-D dirs] "
+			"[-l links] [-s blocks] [-x indirect] [-r seed] <file_system_image>\n");
+	exit(1);
+}
+
+
+void throwerr(char *string)
+{
+	fprintf(stderr, "mkimage: %s\n", string);
+	exit(1);
+}
+
+
+// xorshift64*, so that a seed gives the same image everywhere
+uint64_t rnd(void)
+{
+	seed ^= seed >> 12;
+	seed ^= seed << 25;
+	seed ^= seed >> 27;
+	return seed * 0x2545F4914F6CDD1Dull;
+}
+
+
+// uniform in [0, 1)
+double rndUnit(void)
+{
+	return (rnd() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+
+void addEntry(uint inum, uint index)
+{
+	if(nentry == entrycap)
+	{
+		entrycap = entrycap ? 2 * entrycap : 4096;
+		entries = realloc(entries, entrycap * sizeof(Entry));
+		assert(entries != NULL);
+	}
+	entries[nentry++] = (Entry){inum, index};
+}
+
+
+uint newInode(short type)
+{
+	uint inum = nextinode++;
+
+	dip[inum].type = type;
+	dip[inum].nlink = 1;
+	return inum;
+}
+
+
+// Size of a new file in blocks: geometric with mean meanblocks and at most
+// NDIRECT, or uniform past NDIRECT for the share that uses the indirect block.
+uint fileBlocks(void)
+{
+	uint n = 0;
+
+	if(rndUnit() < indirectratio)
+		return NDIRECT + 1 + rnd() % (blocksize / sizeof(uint));
+	while(n < NDIRECT && rndUnit() >= 1 / (meanblocks + 1))
+		n++;
+	return n;
+}
+
+
+// Builds the tree breadth first, so inode numbers grow with depth.
+void buildTree(void)
+{
+	uint *queue = malloc(ninodes * sizeof(uint)), *parent = malloc(ninodes * sizeof(uint));
+	uint *level = malloc(ninodes * sizeof(uint)), *files = malloc(ninodes * sizeof(uint));
+	uint head = 0, tail = 0, maxinum = ninodes - 1 < MAXINUM ? ninodes - 1 : MAXINUM;
+
+	assert(queue != NULL && parent != NULL && level != NULL && files != NULL);
+
+	uint root = newInode(T_DIR);
+	parent[root] = root;
+	level[root] = 0;
+	queue[tail++] = root;
+	ndirs++;
+
+	while(head < tail)
+	{
+		uint dir = queue[head++];
+
+		firstentry[dir] = nentry;
+		addEntry(dir, 0);
+		addEntry(parent[dir], 1);
+
+		for(uint e = 2; e < fanout + 2; e++)
+		{
+			if(nfiles > 0 && rndUnit() < linkratio)
+			{
+				uint inum = files[rnd() % nfiles];
+				dip[inum].nlink++;
+				addEntry(inum, e);
+				nlinks++;
+				continue;
+			}
+			if(nextinode > maxinum)
+				break;
+
+			if(level[dir] < depth && rndUnit() < dirratio)
+			{
+				uint inum = newInode(T_DIR);
+				parent[inum] = dir;
+				level[inum] = level[dir] + 1;
+				queue[tail++] = inum;
+				addEntry(inum, e);
+				ndirs++;
+			}
+			else
+			{
+				uint inum = newInode(T_FILE);
+				nfileblocks[inum] = fileBlocks();
+				files[nfiles++] = inum;
+				addEntry(inum, e);
+			}
+		}
+		nentries[dir] = nentry - firstentry[dir];
+	}
+
+	free(queue);
+	free(parent);
+	free(level);
+	free(files);
+}
+
+
+void writeBlocks(uint blocknum, void *data, size_t len)
+{
+	if(pwrite(fd, data, len, (off_t)blocknum * blocksize) != (ssize_t)len)
+	{
+		perror("write failed");
+		exit(1);
+	}
+}
+
+
+// Gives inode inum n contiguous data blocks: the direct ones, then the
+// indirect block, then the rest. Files that don't fit any more are left
+// empty; directories must fit.
+void allocBlocks(uint inum, uint n)
+{
+	uint need = n + (n > NDIRECT);
+
+	if(n == 0)
+		return;
+	if(need > size - nextblock)
+	{
+		if(dip[inum].type == T_DIR)
+			throwerr("image too small for the directories.");
+		dip[inum].size = 0;
+		return;
+	}
+
+	for(uint k = 0; k < n && k < NDIRECT; k++)
+		dip[inum].addrs[k] = nextblock++;
+	if(n > NDIRECT)
+	{
+		uint indirect[MAXBSIZE / sizeof(uint)] = {0};
+
+		dip[inum].addrs[NDIRECT] = nextblock++;
+		for(uint k = NDIRECT; k < n; k++)
+			indirect[k - NDIRECT] = nextblock++;
+		writeBlocks(dip[inum].addrs[NDIRECT], indirect, blocksize);
+		nindirect++;
+	}
+}
+
+
+// Returns the number of the k-th block of inode inum.
+uint blockOf(uint inum, uint k)
+{
+	uint indirect[MAXBSIZE / sizeof(uint)];
+
+	if(k < NDIRECT)
+		return dip[inum].addrs[k];
+	if(pread(fd, indirect, blocksize, (off_t)dip[inum].addrs[NDIRECT] * blocksize) != blocksize)
+		throwerr("cannot read back an indirect block.");
+	return indirect[k - NDIRECT];
+}
+
+
+void writeDirectory(uint dir)
+{
+	uint n = nentries[dir];
+	struct dirent *de = calloc(n, sizeof(struct dirent));
+
+	assert(de != NULL);
+	for(uint e = 0; e < n; e++)
+	{
+		Entry *entry = &entries[firstentry[dir] + e];
+
+		de[e].inum = entry->inum;
+		if(entry->index < 2)
+			strcpy(de[e].name, entry->index == 0 ? "." : "..");
+		else
+			snprintf(de[e].name, DIRSIZ, "%c%u", dip[entry->inum].type == T_DIR ? 'd' : 'f', entry->index);
+	}
+
+	for(uint k = 0; k * blocksize < n * sizeof(struct dirent); k++)
+	{
+		size_t len = n * sizeof(struct dirent) - k * blocksize;
+		writeBlocks(blockOf(dir, k), (char *) de + k * blocksize, len < blocksize ? len : blocksize);
+	}
+	free(de);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+	int opt;
+
+	size = 1024;
+	ninodes = 0;
+	while((opt = getopt(argc, argv, "B:b:i:f:d:D:l:s:x:r:")) != -1)
+	{
+		switch(opt)
+		{
+		case 'B': blocksize = strtoul(optarg, NULL, 0); break;
+		case 'b': size = strtoul(optarg, NULL, 0); break;
+		case 'i': ninodes = strtoul(optarg, NULL, 0); break;
+		case 'f': fanout = strtoul(optarg, NULL, 0); break;
+		case 'd': depth = strtoul(optarg, NULL, 0); break;
+		case 'D': dirratio = atof(optarg); break;
+		case 'l': linkratio = atof(optarg); break;
+		case 's': meanblocks = atof(optarg); break;
+		case 'x': indirectratio = atof(optarg); break;
+		case 'r': seed = strtoull(optarg, NULL, 0) | 1; break;
+		default: usage();
+		}
+	}
+	if(optind != argc - 1)
+		usage();
+	if(blocksize < BSIZE || blocksize > MAXBSIZE || (blocksize & (blocksize - 1)) != 0)
+		throwerr("block size must be a power of 2 from 512 to 4096.");
+
+	uint ipb = blocksize / sizeof(struct dinode), bpb = blocksize * 8;
+	if((fanout + 2) * sizeof(struct dirent) > (NDIRECT + blocksize / sizeof(uint)) * blocksize)
+		throwerr("fan-out too large for a directory.");
+
+	if(ninodes == 0) // 200 like mkfs, or an inode per 64 blocks up to what dirents can name
+		ninodes = size / 64 < 200 ? 200 : size / 64 < MAXINUM + 1 ? size / 64 : MAXINUM + 1;
+	ninodes = (ninodes + ipb - 1) / ipb * ipb;
+	if(ninodes < 2 * ipb)
+		ninodes = 2 * ipb;
+
+	// laid out like mkfs: boot block, superblock, inodes, bitmap, data
+	uint bitmapstart = ninodes / ipb + 3;
+	uint datastart = bitmapstart + size / bpb + 1;
+	if(datastart >= size)
+		throwerr("image too small for its inodes and bitmap.");
+
+	dip = calloc(ninodes, sizeof(struct dinode));
+	nfileblocks = calloc(ninodes, sizeof(uint));
+	firstentry = calloc(ninodes, sizeof(uint));
+	nentries = calloc(ninodes, sizeof(uint));
+	assert(dip != NULL && nfileblocks != NULL && firstentry != NULL && nentries != NULL);
+
+	buildTree();
+
+	fd = open(argv[optind], O_RDWR | O_CREAT | O_TRUNC, 0666);
+	if(fd < 0){
+		perror(argv[optind]);
+		exit(1);
+	}
+	if(ftruncate(fd, (off_t)size * blocksize) != 0){
+		perror("ftruncate failed");
+		exit(1);
+	}
+
+	// directories first, so they fit even when the files don't
+	nextblock = datastart;
+	for(uint inum = ROOTINO; inum < nextinode; inum++)
+		if(dip[inum].type == T_DIR)
+		{
+			dip[inum].size = nentries[inum] * sizeof(struct dirent);
+			allocBlocks(inum, (dip[inum].size + blocksize - 1) / blocksize);
+			writeDirectory(inum);
+		}
+	for(uint inum = ROOTINO; inum < nextinode; inum++)
+		if(dip[inum].type == T_FILE && nfileblocks[inum] > 0)
+		{
+			dip[inum].size = nfileblocks[inum] * blocksize - rnd() % blocksize;
+			allocBlocks(inum, nfileblocks[inum]);
+		}
+
+	// other than xv6 blocks, the superblock says what they are
+	uint sb[6] = {size, size - datastart, ninodes, GEOMAGIC, blocksize, NDIRECT};
+	char block[MAXBSIZE] = {0};
+	memcpy(block, sb, blocksize == BSIZE ? 3 * sizeof(uint) : sizeof(sb));
+	writeBlocks(1, block, blocksize);
+	writeBlocks(2, dip, ninodes * sizeof(struct dinode));
+
+	// everything up to nextblock is in use
+	size_t bitmaplen = (size / bpb + 1) * blocksize;
+	uchar *bitmap = calloc(bitmaplen, 1);
+	assert(bitmap != NULL);
+	memset(bitmap, 0xFF, nextblock / 8);
+	for(uint b = nextblock / 8 * 8; b < nextblock; b++)
+		bitmap[b / 8] |= 1 << (b % 8);
+	writeBlocks(bitmapstart, bitmap, bitmaplen);
+
+	printf("%u blocks, %u inodes: %u directories, %u files, %u hard links, "
+			"%u indirect blocks, %u data blocks used\n",
+			size, ninodes, ndirs, nfiles, nlinks, nindirect, nextblock - datastart);
+	close(fd);
+	exit(0);
+}